@@ -8,6 +8,12 @@ struct proc;
 struct spinlock;
 struct sleeplock;
 struct stat;
+struct vdsotime;
+struct kmemstat;
+struct buddystat;
+struct slabcache;
+struct slabstat;
+struct shm;
 struct superblock;
 
 // bio.c
@@ -25,6 +31,8 @@ void            consputc(int);
 
 // exec.c
 int             exec(char*, char**);
+int             execfault(struct proc*, uint64);
+struct inode*   execdetach(struct proc*);
 
 // file.c
 struct file*    filealloc(void);
@@ -64,6 +72,14 @@ void            ramdiskrw(struct buf*);
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void            kref(void *);
+int             krefcount(void *);
+void            kmemstat(int, struct kmemstat *);
+void            kbuddystat(struct buddystat *);
+void*           kalloc_zeroed(void);
+int             kzerofill(void);
+void*           kallocpages(int);
+void            kfreepages(void *, int);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -71,12 +87,39 @@ void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
 
+// mmap.c
+uint64          mmap(uint64, int, int, struct file*, uint64, struct shm*);
+int             munmap(uint64, uint64);
+int             mmapfault(struct proc*, uint64, int);
+int             mmapshare(struct proc*);
+int             mmapfork(struct proc*, struct proc*);
+void            mmapexit(struct proc*);
+int             mmapreap(struct proc*, struct file**);
+uint64          mmapfloor(struct proc*);
+
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
 int             pipewrite(struct pipe*, uint64, int);
 
+// shm.c
+void            shminit(void);
+int             shmget(int, uint64);
+uint64          shmat(int);
+int             shmdt(uint64);
+int             shmrm(int);
+void            shmdup(struct shm*);
+void            shmput(struct shm*);
+uint64          shmpage(struct shm*, uint64);
+
+// slab.c
+void            slabinit(struct slabcache*, char*, uint);
+void*           slaballoc(struct slabcache*);
+void            slabfree(struct slabcache*, void*);
+int             slabstat(int, struct slabstat*);
+
 // printf.c
 void            printf(char*, ...);
 void            panic(char*) __attribute__((noreturn));
@@ -87,7 +130,10 @@ int             cpuid(void);
 void            exit(int);
 int             fork(void);
 int             growproc(int);
-void            proc_mapstacks(pagetable_t);
+int             vmfault(struct proc *, uint64, int);
+int             vmcansleep(void);
+void            vmprefault(uint64, int, int);
+void            tlbshootdown(struct proc *);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
@@ -99,30 +145,55 @@ struct proc*    myproc();
 void            procinit(void);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
+void            setrunnable(struct kthread*);
+void            rqremove(struct kthread*);
+int             schedtick(void);
+int             nice(int);
+int             schedstat(int, uint64, int);
 void            sleep(void*, struct spinlock*);
+void            sleepqinit(void);
+void            sleepqremove(struct kthread*);
 void            userinit(void);
 int             wait(uint64);
 void            wakeup(void*);
+int             wakeup_n(void*, int);
+void            wakeup_one(void*);
 void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
 
+// vdso.c
+extern struct vdsotime *vdsotime;
+void            vdsoinit(void);
+void            vdsotick(uint);
+
+// hrtimer.c
+void            hrtimerinit(void);
+int             hrtimersleep(uint64);
+void            hrtimerintr(void);
+void            hrtimercancel(struct kthread*);
+
 // kthread.c
-void                kthreadinit(struct proc *);
+void                kthreadinit(void);
+void                kstackfence(void);
 struct kthread*     mykthread();
 struct kthread*     allocthread(struct proc *);
 void                freethread(struct kthread *);
-int                 alloctid(struct proc *);
 struct trapframe*   get_kthread_trapframe(struct proc *, struct kthread *);
-int                 kthread_create(void *(*)(), void *, uint);
+int                 kthread_create(void *(*)(), void *, uint, void *);
 void                kthread_exit(int);
 int                 kthread_wakeup(void *);
 int                 kthread_kill(int);
+int                 kthread_setaffinity(int, int);
+int                 kthread_getaffinity(int);
 int                 kthread_killed(struct kthread*);
 void                setkthreadkilled(struct kthread*);
 int                 exit_threads(struct proc *, int);
 int                 kthread_join(int, uint64);
+void                futexinit(void);
+int                 futex_wait(uint64, int);
+int                 futex_wake(uint64, int);
 
 // swtch.S
 void            swtch(struct context*, struct context*);
@@ -181,7 +252,9 @@ pagetable_t     uvmcreate(void);
 void            uvmfirst(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
-int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcopy(pagetable_t, pagetable_t, uint64, uint64, int);
+int             uvmlazy(pagetable_t, uint64);
+int             uvmcow(pagetable_t, uint64, uint64*);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
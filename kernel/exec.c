@@ -6,8 +6,7 @@
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
-
-static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
+#include "vdso.h"
 
 int flags2perm(int flags)
 {
@@ -28,6 +27,9 @@ exec(char *path, char **argv)
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
+  struct execseg segs[NEXECSEG];
+  int nseg = 0;
+  struct inode *exeip = 0, *oldexeip;
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
   struct kthread *kt = mykthread();
@@ -50,7 +52,8 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Record the program's segments. Their pages are read
+  // from ip when first touched; see execfault().
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -62,15 +65,21 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
-      goto bad;
-    sz = sz1;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(ph.vaddr + ph.memsz > VDSOPROC || nseg == NEXECSEG)
       goto bad;
+    segs[nseg].va = ph.vaddr;
+    segs[nseg].memsz = ph.memsz;
+    segs[nseg].filesz = ph.filesz;
+    segs[nseg].off = ph.off;
+    segs[nseg].perm = PTE_R | PTE_U | flags2perm(ph.flags);
+    nseg++;
+    if(ph.vaddr + ph.memsz > sz)
+      sz = ph.vaddr + ph.memsz;
   }
-  iunlockput(ip);
+  // keep the reference to ip for the segments.
+  iunlock(ip);
   end_op();
+  exeip = ip;
   ip = 0;
 
   p = myproc();
@@ -124,13 +133,26 @@ exec(char *path, char **argv)
     
   // Commit to the user image.
   exit_threads(p, 0);
+  mmapexit(p);
   // TODO: maybe join all other threads before exec?
+  acquire(&p->vmlock);
+  oldexeip = execdetach(p);
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
   p->sz = sz;
+  memmove(p->segs, segs, sizeof(segs));
+  p->nseg = nseg;
+  p->exeip = exeip;
+  p->mmapclosed = 0;
+  release(&p->vmlock);
   kt->trapframe->epc = elf.entry;  // initial program counter = main
   kt->trapframe->sp = sp; // initial stack pointer
   proc_freepagetable(oldpagetable, oldsz);
+  if(oldexeip){
+    begin_op();
+    iput(oldexeip);
+    end_op();
+  }
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
@@ -141,30 +163,92 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op();
   }
+  if(exeip){
+    begin_op();
+    iput(exeip);
+    end_op();
+  }
   return -1;
 }
 
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
+// Fault in the page at va of p's program image, if it lies
+// in a segment exec() recorded and is not mapped yet: map a
+// page holding the segment's file contents, zero past its
+// file size. Returns 0 if the access can be retried, -1 if
+// the page cannot be loaded, 1 if va is not such a page.
+int
+execfault(struct proc *p, uint64 va)
 {
-  uint i, n;
-  uint64 pa;
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
-      return -1;
+  struct execseg *s, seg;
+  struct inode *ip;
+  pte_t *pte;
+  char *mem;
+  uint64 n;
+  int r;
+  // reading the program sleeps; see vmprefault().
+  int cansleep = vmcansleep();
+
+  va = PGROUNDDOWN(va);
+  acquire(&p->vmlock);
+  for(s = p->segs; s < &p->segs[p->nseg]; s++)
+    if(va >= s->va && va < s->va + s->memsz)
+      break;
+  pte = walk(p->pagetable, va, 0);
+  if(s == &p->segs[p->nseg] || (pte && (*pte & PTE_V))){
+    release(&p->vmlock);
+    return 1;
+  }
+  if(!cansleep){
+    release(&p->vmlock);
+    return -1;
+  }
+  // p->exeip stays put until execdetach() has seen
+  // this read finish.
+  seg = *s;
+  ip = p->exeip;
+  p->nexecio++;
+  release(&p->vmlock);
+
+  n = 0;
+  if(va - seg.va < seg.filesz)
+    n = seg.filesz - (va - seg.va) < PGSIZE ? seg.filesz - (va - seg.va) : PGSIZE;
+  r = -1;
+  if((mem = kalloc_zeroed()) != 0){
+    ilock(ip);
+    if(readi(ip, 0, (uint64)mem, seg.off + (va - seg.va), n) == n)
+      r = 0;
+    iunlock(ip);
   }
-  
-  return 0;
+
+  acquire(&p->vmlock);
+  if(--p->nexecio == 0)
+    wakeup(&p->nexecio);
+  pte = walk(p->pagetable, va, 0);
+  if(r < 0 || (pte && (*pte & PTE_V))){
+    // failed, or another kthread loaded it.
+    if(mem)
+      kfree(mem);
+  } else if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, seg.perm) != 0){
+    kfree(mem);
+    r = -1;
+  }
+  release(&p->vmlock);
+  return r;
+}
+
+// Stop p's kthreads loading more of its program, wait for
+// the loads under way, and hand back p's reference to the
+// program's inode, for the caller to iput(). Caller holds
+// p->vmlock, which this releases while it waits.
+struct inode *
+execdetach(struct proc *p)
+{
+  struct inode *ip;
+
+  p->nseg = 0;
+  while(p->nexecio > 0)
+    sleep(&p->nexecio, &p->vmlock);
+  ip = p->exeip;
+  p->exeip = 0;
+  return ip;
 }
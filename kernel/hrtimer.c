@@ -0,0 +1,177 @@
+// High-resolution timers.
+//
+// Sleepers wait on the struct hrtimer in their kthread, kept
+// in a min-heap ordered by deadline (a time CSR value). A
+// kthread torn down while asleep is taken out of the heap by
+// hrtimercancel().
+// hrtimerintr() runs on every timer interrupt and IPI; it wakes
+// just the sleepers whose deadlines have passed, and asks
+// timervec (kernelvec.S) for an interrupt at the next deadline
+// if that comes before the next tick.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+static struct spinlock timerlock;  // protects the heap
+static struct hrtimer *heap[NTHREAD];
+static int ntimer;
+
+// earliest deadline in the heap, or ~0. Read without
+// timerlock as a cheap "anything due?" check.
+static volatile uint64 nextdeadline = ~0ULL;
+
+// in start.c, shared with timervec.
+extern uint64 timer_scratch[NCPU][NSCRATCH];
+
+void
+hrtimerinit(void)
+{
+  initlock(&timerlock, "timer");
+}
+
+static void
+heapswap(int i, int j)
+{
+  struct hrtimer *t = heap[i];
+
+  heap[i] = heap[j];
+  heap[j] = t;
+  heap[i]->idx = i;
+  heap[j]->idx = j;
+}
+
+// Restore heap order around heap[i]. Caller holds timerlock.
+static void
+heapfix(int i)
+{
+  int c;
+
+  while (i > 0 && heap[i]->deadline < heap[(i - 1) / 2]->deadline)
+  {
+    heapswap(i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+  for (;;)
+  {
+    c = 2 * i + 1;
+    if (c >= ntimer)
+      break;
+    if (c + 1 < ntimer && heap[c + 1]->deadline < heap[c]->deadline)
+      c++;
+    if (heap[i]->deadline <= heap[c]->deadline)
+      break;
+    heapswap(i, c);
+    i = c;
+  }
+}
+
+static void
+heapremove(struct hrtimer *t)
+{
+  int i = t->idx;
+
+  ntimer--;
+  if (i != ntimer)
+  {
+    heap[i] = heap[ntimer];
+    heap[i]->idx = i;
+    heapfix(i);
+  }
+  t->idx = -1;
+  nextdeadline = ntimer ? heap[0]->deadline : ~0ULL;
+}
+
+// Have this cpu interrupted by deadline d, unless it already
+// will be by then. Interrupts must be off.
+static void
+hrtimerarm(uint64 d)
+{
+  int id = cpuid();
+  uint64 *scratch = timer_scratch[id];
+
+  // scratch[7] is the next tick, scratch[8] the deadline
+  // timervec programs into mtimecmp along with it.
+  if (d >= scratch[8])
+    return;
+  scratch[8] = d;
+  // a self-IPI makes timervec reprogram mtimecmp now.
+  if (d < scratch[7])
+    *(volatile uint32 *)CLINT_MSIP(id) = 1;
+}
+
+// Sleep until the time CSR reaches deadline.
+// Returns -1 if killed first, else 0.
+int
+hrtimersleep(uint64 deadline)
+{
+  struct hrtimer *t = &mykthread()->timer;
+  int k;
+
+  acquire(&timerlock);
+  t->deadline = deadline;
+  t->idx = ntimer++;
+  heap[t->idx] = t;
+  heapfix(t->idx);
+  nextdeadline = heap[0]->deadline;
+  push_off();
+  hrtimerarm(deadline);
+  pop_off();
+
+  while (t->idx >= 0)
+  {
+    // killed() takes p->lock, which exit() holds while it
+    // takes timerlock in hrtimercancel().
+    release(&timerlock);
+    k = killed(myproc()) || kthread_killed(mykthread());
+    acquire(&timerlock);
+    if (k)
+    {
+      if (t->idx >= 0)
+        heapremove(t);
+      release(&timerlock);
+      return -1;
+    }
+    if (t->idx >= 0)
+      sleep(t, &timerlock);
+  }
+  release(&timerlock);
+  return 0;
+}
+
+// Take kt's timer out of the heap, if kt was torn down in
+// hrtimersleep() (see exit_threads()). Call without kt->lock,
+// which sleep() takes inside timerlock.
+void
+hrtimercancel(struct kthread *kt)
+{
+  acquire(&timerlock);
+  if (kt->timer.idx >= 0)
+    heapremove(&kt->timer);
+  release(&timerlock);
+}
+
+// Wake sleepers whose deadlines have passed and re-arm this
+// cpu for the next one. Called from devintr().
+void
+hrtimerintr(void)
+{
+  struct hrtimer *t;
+  uint64 now = r_time();
+
+  if (nextdeadline <= now)
+  {
+    acquire(&timerlock);
+    while (ntimer > 0 && (t = heap[0])->deadline <= now)
+    {
+      heapremove(t);
+      wakeup(t);
+    }
+    release(&timerlock);
+  }
+  hrtimerarm(nextdeadline);
+}
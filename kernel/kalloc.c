@@ -1,6 +1,9 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// or, from kallocpages(), aligned runs of 2^order pages.
+// kalloc_zeroed() hands out pages that idle cpus zeroed
+// ahead of time.
 
 #include "types.h"
 #include "param.h"
@@ -8,6 +11,7 @@
 #include "spinlock.h"
 #include "riscv.h"
 #include "defs.h"
+#include "schedstat.h"
 
 void freerange(void *pa_start, void *pa_end);
 
@@ -16,18 +20,71 @@ extern char end[]; // first address after kernel.
 
 struct run {
   struct run *next;
+  struct run *prev;            // only on the buddy lists
 };
 
+#define NPAGE ((PHYSTOP - KERNBASE) / PGSIZE)
+#define PAGENO(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+#define BFREE 0x80             // in kmem.order: heads a free block
+
+// The shared pool, a buddy allocator: a free block of 2^k
+// pages starts at a multiple of 2^k pages from KERNBASE, and
+// on free merges with its buddy, the other half of the block
+// of 2^(k+1) pages, whenever that is free too. Each cpu also
+// keeps a free list of single pages of its own and moves
+// pages to and from the pool KBATCH at a time, so most
+// kalloc() and kfree() calls take no shared lock.
 struct {
   struct spinlock lock;
-  struct run *freelist;
+  struct run *freelist[KMAXORDER+1]; // free blocks of 2^k pages
+  uint64 nblock[KMAXORDER+1];
+  int nfree;                   // pages in free blocks
+  uint64 nsplit;
+  uint64 nmerge;
+  uint64 nfail;
+  uchar order[NPAGE];          // BFREE|k at the first page of a free block
+  // references to each page: one from kalloc(), plus one
+  // for each extra page table sharing it copy-on-write.
+  // updated atomically, without lock.
+  int ref[NPAGE];
 } kmem;
 
+// A cpu's own free list. The lock is needed because other
+// cpus steal from it when both their list and the pool are
+// empty; a cpu never holds another's lock while holding its
+// own, and takes kmem.lock only while holding its own.
+struct kcpu {
+  struct spinlock lock;
+  struct run *freelist;
+  int nfree;
+  uint64 nalloc;               // kalloc() calls that got a page
+  uint64 nkfree;               // pages freed to this list
+  uint64 nsteal;               // pages taken from other cpus' lists
+} kcpus[NCPU];
+
+// Pages zeroed by idle cpus, see kzerofill(). Each already
+// has its reference from kalloc().
+struct {
+  struct spinlock lock;
+  struct run *freelist;
+  int n;
+  uint64 nhit;                 // kalloc_zeroed() calls served from here
+  uint64 nmiss;                // kalloc_zeroed() calls that had to zero
+} kzero;
+
+#define PAREF(pa) (&kmem.ref[PAGENO(pa)])
+
+static void bfree(struct run *r, int order);
+
 void
 kinit()
 {
   initlock(&kmem.lock, "kmem");
+  initlock(&kzero.lock, "kzero");
+  for(struct kcpu *kc = kcpus; kc < &kcpus[NCPU]; kc++)
+    initlock(&kc->lock, "kcpu");
   freerange(end, (void*)PHYSTOP);
+  kmem.nmerge = 0;
 }
 
 void
@@ -35,33 +92,249 @@ freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
+  acquire(&kmem.lock);
   for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+    bfree((struct run*)p, 0);
+  release(&kmem.lock);
 }
 
-// Free the page of physical memory pointed at by pa,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Put r on the list of free blocks of 2^k pages.
+static void
+blink(struct run *r, int k)
+{
+  r->prev = 0;
+  r->next = kmem.freelist[k];
+  if(r->next)
+    r->next->prev = r;
+  kmem.freelist[k] = r;
+  kmem.order[PAGENO(r)] = BFREE | k;
+  kmem.nblock[k]++;
+}
+
+// Take r off the list of free blocks of 2^k pages.
+static void
+bunlink(struct run *r, int k)
+{
+  if(r->prev)
+    r->prev->next = r->next;
+  else
+    kmem.freelist[k] = r->next;
+  if(r->next)
+    r->next->prev = r->prev;
+  kmem.order[PAGENO(r)] = 0;
+  kmem.nblock[k]--;
+}
+
+// Allocate a block of 2^order pages from the pool,
+// splitting a bigger one if need be.
+// Caller holds kmem.lock.
+static struct run *
+balloc(int order)
+{
+  struct run *r;
+  int k;
+
+  for(k = order; k <= KMAXORDER && kmem.freelist[k] == 0; k++)
+    ;
+  if(k > KMAXORDER){
+    if(kmem.nfree >= (1 << order))
+      kmem.nfail++;            // enough memory, but not contiguous
+    return 0;
+  }
+  r = kmem.freelist[k];
+  bunlink(r, k);
+  while(k > order){
+    // keep the lower half, free the upper.
+    k--;
+    blink((struct run*)((char*)r + ((uint64)PGSIZE << k)), k);
+    kmem.nsplit++;
+  }
+  kmem.nfree -= 1 << order;
+  return r;
+}
+
+// Return a block of 2^order pages to the pool, merging it
+// with its buddy for as long as the buddy is free too.
+// Caller holds kmem.lock.
+static void
+bfree(struct run *r, int order)
+{
+  uint64 pa = (uint64)r, b;
+
+  kmem.nfree += 1 << order;
+  while(order < KMAXORDER){
+    b = KERNBASE + ((pa - KERNBASE) ^ ((uint64)PGSIZE << order));
+    if(b >= PHYSTOP || kmem.order[PAGENO(b)] != (BFREE | order))
+      break;
+    bunlink((struct run*)b, order);
+    if(b < pa)
+      pa = b;
+    order++;
+    kmem.nmerge++;
+  }
+  blink((struct run*)pa, order);
+}
+
+// Drop a reference to the page of physical memory pointed
+// at by pa, and free it if that was the last one. pa should
+// normally have been returned by a call to kalloc().  (The
+// exception is when initializing the allocator; see kinit above.)
 void
 kfree(void *pa)
 {
   struct run *r;
+  struct kcpu *kc;
+  int n;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  if((n = __sync_sub_and_fetch(PAREF(pa), 1)) > 0)
+    return;
+  if(n < 0)
+    panic("kfree: ref");
+
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
 
   r = (struct run*)pa;
 
+  push_off();
+  kc = &kcpus[cpuid()];
+  acquire(&kc->lock);
+  r->next = kc->freelist;
+  kc->freelist = r;
+  kc->nfree++;
+  kc->nkfree++;
+  if(kc->nfree >= 2*KBATCH){
+    // spill a batch to the pool for other cpus.
+    acquire(&kmem.lock);
+    while(kc->nfree > KBATCH){
+      r = kc->freelist;
+      kc->freelist = r->next;
+      kc->nfree--;
+      bfree(r, 0);
+    }
+    release(&kmem.lock);
+  }
+  release(&kc->lock);
+  pop_off();
+}
+
+// Move up to KBATCH pages from the pool to kc's list.
+// Caller holds kc->lock.
+static void
+refill(struct kcpu *kc)
+{
+  struct run *r;
+
   acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
+  for(int i = 0; i < KBATCH && (r = balloc(0)) != 0; i++){
+    r->next = kc->freelist;
+    kc->freelist = r;
+    kc->nfree++;
+  }
   release(&kmem.lock);
 }
 
+// Take half of some other cpu's free list, at most KBATCH
+// pages, for kc, which belongs to the calling cpu. Caller
+// holds no kcpu lock. Returns the number of pages taken.
+static int
+steal(struct kcpu *kc)
+{
+  struct kcpu *v;
+  struct run *r, *head = 0, *tail = 0;
+  int n = 0;
+
+  for(v = kcpus; v < &kcpus[NCPU] && n == 0; v++){
+    if(v == kc || v->nfree == 0)
+      continue;
+    acquire(&v->lock);
+    while(v->freelist && (n == 0 || (n < KBATCH && n < v->nfree))){
+      r = v->freelist;
+      v->freelist = r->next;
+      v->nfree--;
+      r->next = head;
+      head = r;
+      if(tail == 0)
+        tail = r;
+      n++;
+    }
+    release(&v->lock);
+  }
+  if(n == 0)
+    return 0;
+
+  acquire(&kc->lock);
+  tail->next = kc->freelist;
+  kc->freelist = head;
+  kc->nfree += n;
+  kc->nsteal += n;
+  release(&kc->lock);
+  return n;
+}
+
+// Take a page from the calling cpu's free list, the pool,
+// or another cpu, with its first reference; no fill. Count
+// it as allocated on this cpu if count is set; a page for
+// the zeroed pool is counted when it leaves the pool.
+static struct run *
+allocpage(int count)
+{
+  struct run *r;
+  struct kcpu *kc;
+
+  push_off();
+  kc = &kcpus[cpuid()];
+  for(;;){
+    acquire(&kc->lock);
+    if(kc->freelist == 0)
+      refill(kc);
+    if((r = kc->freelist) != 0){
+      kc->freelist = r->next;
+      kc->nfree--;
+      if(count)
+        kc->nalloc++;
+    }
+    release(&kc->lock);
+    if(r || steal(kc) == 0)
+      break;
+  }
+  pop_off();
+
+  if(r)
+    *PAREF(r) = 1;
+  return r;
+}
+
+// Take a page from the pre-zeroed pool, or return 0.
+// The caller must clear r->next, the only nonzero word.
+static struct run *
+zeropop(void)
+{
+  struct run *r;
+
+  acquire(&kzero.lock);
+  if((r = kzero.freelist) != 0){
+    kzero.freelist = r->next;
+    kzero.n--;
+  }
+  release(&kzero.lock);
+  return r;
+}
+
+// Count a page taken from the zeroed pool as allocated on
+// the calling cpu. Only this cpu writes its nalloc, and
+// only with interrupts off, so no lock is needed.
+static void
+countzero(void)
+{
+  push_off();
+  kcpus[cpuid()].nalloc++;
+  pop_off();
+}
+
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
@@ -70,13 +343,143 @@ kalloc(void)
 {
   struct run *r;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
+  if((r = allocpage(1)) == 0 && (r = zeropop()) != 0)
+    countzero();               // nothing left but zeroed pages
   if(r)
-    kmem.freelist = r->next;
+    memset((char*)r, 5, PGSIZE); // fill with junk
+  return (void*)r;
+}
+
+// Like kalloc(), but the page is filled with zeros, usually
+// ahead of time by an idle cpu, so the caller need not.
+void *
+kalloc_zeroed(void)
+{
+  struct run *r;
+
+  if((r = zeropop()) != 0){
+    r->next = 0;
+    countzero();
+    __sync_fetch_and_add(&kzero.nhit, 1);
+  } else {
+    __sync_fetch_and_add(&kzero.nmiss, 1);
+    if((r = allocpage(1)) != 0)
+      memset((char*)r, 0, PGSIZE);
+  }
+  return (void*)r;
+}
+
+// Called by an idle cpu: zero a page for kalloc_zeroed()
+// if the pool is short of KZEROPOOL. Returns 1 if it did,
+// so the caller should look for work again before waiting,
+// 0 if there was nothing to do.
+int
+kzerofill(void)
+{
+  struct run *r;
+
+  if(kzero.n >= KZEROPOOL || (r = allocpage(0)) == 0)
+    return 0;
+  memset((char*)r, 0, PGSIZE);
+  acquire(&kzero.lock);
+  r->next = kzero.freelist;
+  kzero.freelist = r;
+  kzero.n++;
+  release(&kzero.lock);
+  return 1;
+}
+
+// Allocate 2^order physically contiguous pages, aligned to
+// their size, for the kernel; free with kfreepages(). Pages
+// on the cpus' free lists are not in the pool, so a big
+// block can fail even though enough single pages are free.
+// Returns 0 if the memory cannot be allocated.
+void *
+kallocpages(int order)
+{
+  struct run *r;
+
+  if(order < 0 || order > KMAXORDER)
+    return 0;
+  if(order == 0)
+    return kalloc();
+
+  acquire(&kmem.lock);
+  r = balloc(order);
   release(&kmem.lock);
 
-  if(r)
-    memset((char*)r, 5, PGSIZE); // fill with junk
+  if(r){
+    *PAREF(r) = 1;
+    memset((char*)r, 5, (uint64)PGSIZE << order); // fill with junk
+  }
   return (void*)r;
 }
+
+// Free the 2^order pages at pa, from kallocpages(order).
+void
+kfreepages(void *pa, int order)
+{
+  if(order == 0){
+    kfree(pa);
+    return;
+  }
+  if(order < 0 || order > KMAXORDER ||
+     ((uint64)pa - KERNBASE) % ((uint64)PGSIZE << order) != 0 ||
+     (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kfreepages");
+  if(__sync_sub_and_fetch(PAREF(pa), 1) != 0)
+    panic("kfreepages: ref");
+
+  memset(pa, 1, (uint64)PGSIZE << order);
+
+  acquire(&kmem.lock);
+  bfree((struct run*)pa, order);
+  release(&kmem.lock);
+}
+
+// Add a reference to a page returned by kalloc(),
+// for another page table that shares it.
+void
+kref(void *pa)
+{
+  __sync_fetch_and_add(PAREF(pa), 1);
+}
+
+// The number of references to page pa.
+int
+krefcount(void *pa)
+{
+  return *(volatile int*)PAREF(pa);
+}
+
+// Fill in *st with cpu's allocator counters.
+void
+kmemstat(int cpu, struct kmemstat *st)
+{
+  struct kcpu *kc = &kcpus[cpu];
+
+  // racy snapshot, like the scheduler counters.
+  st->cpu = cpu;
+  st->nfree = kc->nfree;
+  st->npool = kmem.nfree;
+  st->nalloc = kc->nalloc;
+  st->nkfree = kc->nkfree;
+  st->nsteal = kc->nsteal;
+}
+
+// Fill in *st with the pool's free blocks and counters.
+void
+kbuddystat(struct buddystat *st)
+{
+  acquire(&kmem.lock);
+  st->npool = kmem.nfree;
+  for(int k = 0; k <= KMAXORDER; k++)
+    st->nblock[k] = kmem.nblock[k];
+  st->nsplit = kmem.nsplit;
+  st->nmerge = kmem.nmerge;
+  st->nfail = kmem.nfail;
+  release(&kmem.lock);
+  st->nzero = kzero.n;
+  st->nzerohit = kzero.nhit;
+  st->nzeromiss = kzero.nmiss;
+}
@@ -5,25 +5,81 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "fcntl.h"
 
-extern struct proc proc[NPROC];
 extern void forkret(void);
+extern pagetable_t kernel_pagetable; // vm.c
+
+// kthreads are handed out to processes on demand from this
+// system-wide pool; a process only holds pointers to the ones
+// it is using, in p->kthread[].
+struct kthread kthreads[NTHREAD];
 
 extern struct spinlock wait_lock;
 
-void kthreadinit(struct proc *p)
+// serialises futex value checks against futex wakeups.
+struct spinlock futex_lock;
+
+static struct spinlock kstacklock; // serialises kstackmap()
+static uint64 kstackgen;           // kernel stacks mapped so far
+
+void futexinit(void)
 {
-  initlock(&p->tid_lock, "nexttid");
+  initlock(&futex_lock, "futex");
+}
 
-  for (struct kthread *kt = p->kthread; kt < &p->kthread[NKT]; kt++)
+// initialize the kthread pool.
+void kthreadinit(void)
+{
+  initlock(&kstacklock, "kstack");
+  for (struct kthread *kt = kthreads; kt < &kthreads[NTHREAD]; kt++)
   {
     initlock(&kt->lock, "thread");
+    kt->timer.idx = -1;
     kt->tstate = UNUSED;
-    kt->proc = p;
+  }
+}
+
+// A kthread's kernel stack is mapped at KSTACK() of its
+// index in the pool, with an invalid guard page below, the
+// first time the kthread is handed out. It stays mapped when
+// the kthread is freed, for the next user of the kthread, so
+// stack memory follows the most kthreads ever live at once,
+// not the size of the pool, and the kernel page table only
+// ever gains mappings.
+static uint64
+kstackmap(struct kthread *kt)
+{
+  uint64 va = KSTACK((int)(kt - kthreads));
+  char *pa;
+
+  if ((pa = kalloc()) == 0)
+    return 0;
+  acquire(&kstacklock);
+  if (mappages(kernel_pagetable, va, PGSIZE, (uint64)pa, PTE_R | PTE_W) != 0)
+  {
+    release(&kstacklock);
+    kfree(pa);
+    return 0;
+  }
+  __sync_fetch_and_add(&kstackgen, 1);
+  release(&kstacklock);
+  sfence_vma();
+  return va;
+}
+
+// Another cpu may have mapped a stack since this one last
+// flushed its TLB, and a TLB may hold an invalid entry. The
+// scheduler calls this before switching to a kthread.
+void kstackfence(void)
+{
+  struct cpu *c = mycpu();
+  uint64 gen = *(volatile uint64 *)&kstackgen;
 
-    // WARNING: Don't change this line!
-    // get the pointer to the kernel stack of the kthread
-    kt->kstack = KSTACK((int)((p - proc) * NKT + (kt - p->kthread)));
+  if (c->kstackgen != gen)
+  {
+    c->kstackgen = gen;
+    sfence_vma();
   }
 }
 
@@ -36,15 +92,87 @@ struct kthread *mykthread(void)
   return kt;
 }
 
-// Look in the kthread table for an UNUSED kthread.
-// If found, initialize state required to run in the kernel,
-// and return with kt->lock held.
-// If there are no free kthreads, or a memory allocation fails, return 0.
+// Give kt the lowest free slot in p->kthread[], making sure
+// the trapframe page for that slot exists and is mapped in
+// p->pagetable, then give it the next tid and enter it in
+// p's tid index. Returns the slot, or -1 if p already has NKT
+// kthreads or a memory allocation fails.
+static int
+allocslot(struct proc *p, struct kthread *kt)
+{
+  int slot, n;
+  struct trapframe *tf;
+
+  acquire(&p->tid_lock);
+  for (slot = 0; slot < NKT; slot++)
+    if (p->kthread[slot] == 0)
+      break;
+  if (slot == NKT)
+  {
+    release(&p->tid_lock);
+    return -1;
+  }
+
+  n = slot / TFPERPAGE;
+  if (p->trapframes[n] == 0)
+  {
+    if ((tf = (struct trapframe *)kalloc()) == 0)
+    {
+      release(&p->tid_lock);
+      return -1;
+    }
+    if (mappages(p->pagetable, TFPAGE(n), PGSIZE, (uint64)tf, PTE_R | PTE_W) < 0)
+    {
+      kfree((void *)tf);
+      release(&p->tid_lock);
+      return -1;
+    }
+    p->trapframes[n] = tf;
+  }
+
+  p->kthread[slot] = kt;
+  kt->tid = p->next_tid++;
+  kt->tidnext = p->tidhash[kt->tid % NTIDHASH];
+  p->tidhash[kt->tid % NTIDHASH] = kt;
+  release(&p->tid_lock);
+  return slot;
+}
+
+// Look up the kthread of p with the given tid in p's tid index.
+// Returns it with kt->lock held, or 0 if there is none.
+static struct kthread *
+findthread(struct proc *p, int tid)
+{
+  struct kthread *kt;
+
+  acquire(&p->tid_lock);
+  for (kt = p->tidhash[tid % NTIDHASH]; kt; kt = kt->tidnext)
+    if (kt->tid == tid)
+      break;
+  release(&p->tid_lock);
+  if (kt == 0)
+    return 0;
+
+  // it may have been freed since we dropped tid_lock.
+  acquire(&kt->lock);
+  if (kt->proc != p || kt->tid != tid || kt->tstate == UNUSED)
+  {
+    release(&kt->lock);
+    return 0;
+  }
+  return kt;
+}
+
+// Look in the kthread pool for an UNUSED kthread and give it
+// a slot in p. If found, initialize state required to run in
+// the kernel, and return with kt->lock held.
+// If there are no free kthreads, p has NKT of them already,
+// or a memory allocation fails, return 0.
 struct kthread *allocthread(struct proc *p)
 {
   struct kthread *kt;
 
-  for (kt = p->kthread; kt < &p->kthread[NKT]; kt++)
+  for (kt = kthreads; kt < &kthreads[NTHREAD]; kt++)
   {
     acquire(&kt->lock);
     if (kt->tstate == UNUSED)
@@ -59,8 +187,28 @@ struct kthread *allocthread(struct proc *p)
   return 0;
 
 found:
-  kt->tid = alloctid(p);
+  if (kt->kstack == 0 && (kt->kstack = kstackmap(kt)) == 0)
+  {
+    release(&kt->lock);
+    return 0;
+  }
+  if ((kt->slot = allocslot(p, kt)) < 0)
+  {
+    release(&kt->lock);
+    return 0;
+  }
+  kt->proc = p;
   kt->tstate = USED;
+  // start out on the creating cpu's run queue,
+  // allowed on the same cpus as the creating thread.
+  kt->cpu = cpuid();
+  kt->affinity = mykthread() ? mykthread()->affinity : AFFINITY_ALL;
+  kt->nice = mykthread() ? mykthread()->nice : 0;
+  kt->prio = kt->nice;
+  kt->ticks = 0;
+  kt->epoch = ticks / MLFQBOOST;
+  kt->runwait = kt->cputime = 0;
+  kt->nvcsw = kt->nivcsw = 0;
   kt->trapframe = get_kthread_trapframe(p, kt);
 
   // Set up new context to start executing at forkret,
@@ -72,10 +220,32 @@ found:
   return kt;
 }
 
-// free a kthread structure and the data hanging from it,
-// kt->lock must be held.
+// free a kthread structure and return it to the pool,
+// giving up its slot and tid in its process. kt->lock must be held.
+// The trapframe page stays with the process until freeproc(),
+// and the kernel stack with the kthread.
 void freethread(struct kthread *kt)
 {
+  struct proc *p = kt->proc;
+  struct kthread **pp;
+
+  if (kt->tstate == UNUSED)
+    return;
+
+  rqremove(kt);
+  acquire(&p->tid_lock);
+  p->kthread[kt->slot] = 0;
+  for (pp = &p->tidhash[kt->tid % NTIDHASH]; *pp; pp = &(*pp)->tidnext)
+  {
+    if (*pp == kt)
+    {
+      *pp = kt->tidnext;
+      break;
+    }
+  }
+  kt->tidnext = 0;
+  release(&p->tid_lock);
+
   memset(&kt->context, 0, sizeof(kt->context));
   kt->trapframe = 0;
   kt->tstate = UNUSED;
@@ -83,26 +253,16 @@ void freethread(struct kthread *kt)
   kt->killed = 0;
   kt->xstate = 0;
   kt->tid = 0;
-}
-
-int alloctid(struct proc *p)
-{
-  int tid;
-
-  acquire(&p->tid_lock);
-  tid = p->next_tid;
-  p->next_tid = tid + 1;
-  release(&p->tid_lock);
-
-  return tid;
+  kt->slot = 0;
+  kt->proc = 0;
 }
 
 struct trapframe *get_kthread_trapframe(struct proc *p, struct kthread *kt)
 {
-  return p->base_trapframes + ((int)(kt - p->kthread));
+  return p->trapframes[kt->slot / TFPERPAGE] + (kt->slot % TFPERPAGE);
 }
 
-int kthread_create(void *(*start_func)(), void *stack, uint stack_size)
+int kthread_create(void *(*start_func)(), void *stack, uint stack_size, void *tls)
 {
   struct proc *p = myproc();
   struct kthread *kt;
@@ -114,10 +274,14 @@ int kthread_create(void *(*start_func)(), void *stack, uint stack_size)
   int tid = kt->tid;
 
   // Set up new context to start executing at start_func,
-  // which returns to user space.
+  // which returns to user space. The slot's trapframe may hold
+  // registers of an earlier thread, so start from a clean one.
+  // tp points at the thread's TLS block (see kthread_tls_init()).
+  memset(kt->trapframe, 0, sizeof(*kt->trapframe));
   kt->trapframe->epc = (uint64)start_func;
   kt->trapframe->sp = (uint64)stack + stack_size;
-  kt->tstate = RUNNABLE;
+  kt->trapframe->tp = (uint64)tls;
+  setrunnable(kt);
   release(&kt->lock);
 
   return tid;
@@ -130,15 +294,13 @@ void kthread_exit(int status)
 
   int found_alive = 0;
 
-  for (kt = p->kthread; kt < &p->kthread[NKT]; kt++)
+  for (int i = 0; i < NKT && !found_alive; i++)
   {
+    if ((kt = p->kthread[i]) == 0 || kt == mykthread())
+      continue;
     acquire(&kt->lock);
-    if (kt != mykthread() && kt->tstate != ZOMBIE)
-    {
+    if (kt->proc == p && kt->tstate != ZOMBIE && kt->tstate != UNUSED)
       found_alive = 1;
-      release(&kt->lock);
-      break;
-    }
     release(&kt->lock);
   }
 
@@ -163,48 +325,74 @@ void kthread_exit(int status)
   panic("kt zombie exit");
 }
 
+// wake the kthreads joining on chan; only those actually
+// sleeping on it are visited, see wakeup().
 int kthread_wakeup(void *chan)
 {
-  struct kthread *kt;
+  wakeup(chan);
+  return 0;
+}
+
+int kthread_kill(int ktid)
+{
   struct proc *p = myproc();
+  struct kthread *kt;
+
+  if ((kt = findthread(p, ktid)) == 0)
+    return -1; // no matching tid found within process
 
-  for (kt = p->kthread; kt < &p->kthread[NKT]; kt++)
+  kt->killed = 1;
+  if (kt->tstate == SLEEPING)
   {
-    if (kt != mykthread())
-    {
-      acquire(&kt->lock);
-      if (kt->tstate == SLEEPING && kt->chan == chan)
-      {
-        kt->tstate = RUNNABLE;
-      }
-      release(&kt->lock);
-    }
+    setrunnable(kt);
   }
-
+  release(&kt->lock);
   return 0;
 }
 
-int kthread_kill(int ktid)
+// Restrict kthread ktid to the cpus in mask. A queued
+// kthread moves to an allowed cpu right away; a running one
+// moves the next time it becomes RUNNABLE.
+int kthread_setaffinity(int ktid, int mask)
 {
   struct proc *p = myproc();
   struct kthread *kt;
+  struct cpu *c;
+  int online = 0;
+
+  for (c = cpus; c < &cpus[NCPU]; c++)
+    if (c->online)
+      online |= 1 << (c - cpus);
+  mask &= AFFINITY_ALL;
+  if ((mask & online) == 0)
+    return -1;
 
-  for (kt = p->kthread; kt < &p->kthread[NKT]; kt++)
+  if ((kt = findthread(p, ktid)) == 0)
+    return -1;
+  kt->affinity = mask;
+  if (kt->tstate == RUNNABLE && (mask & (1 << kt->cpu)) == 0)
   {
-    acquire(&kt->lock);
-    if (kt->tid == ktid)
-    {
-      kt->killed = 1;
-      if (kt->tstate == SLEEPING)
-      {
-        kt->tstate = RUNNABLE;
-      }
-      return 0;
-    }
-    release(&kt->lock);
+    rqremove(kt);
+    setrunnable(kt);
   }
+  release(&kt->lock);
+
+  // get off a cpu we may no longer use.
+  if (ktid == mykthread()->tid && (mask & (1 << cpuid())) == 0)
+    yield();
+  return 0;
+}
 
-  return -1; // no matching tid found within process
+int kthread_getaffinity(int ktid)
+{
+  struct kthread *kt;
+  int mask;
+
+  if ((kt = findthread(myproc(), ktid)) == 0)
+    return -1;
+  mask = kt->affinity;
+  release(&kt->lock);
+  return mask;
 }
 
 int kthread_killed(struct kthread *kt)
@@ -227,41 +415,37 @@ void setkthreadkilled(struct kthread *kt)
 // calling thread holding lock
 int exit_threads(struct proc *p, int status)
 {
-  for (struct kthread *kt = p->kthread; kt < &p->kthread[NKT]; kt++)
+  struct kthread *kt;
+
+  for (int i = 0; i < NKT; i++)
   {
-    if (kt != mykthread())
+    if ((kt = p->kthread[i]) == 0 || kt == mykthread())
+      continue;
+    acquire(&kt->lock);
+    if (kt->proc == p && kt->tstate != UNUSED)
     {
-      acquire(&kt->lock);
+      rqremove(kt);
+      if (kt->tstate == SLEEPING)
+        sleepqremove(kt);
       kt->xstate = status;
       kt->tstate = ZOMBIE;
-      release(&kt->lock);
     }
+    release(&kt->lock);
+    // its stack and timer go to the next user of kt.
+    hrtimercancel(kt);
   }
   return 0;
 }
 
 int kthread_join(int ktid, uint64 addr)
 {
-  struct proc *p;
+  struct proc *p = myproc();
 
-  // find the kthread with the given tid
+  // find the kthread with the given tid; tids are per process.
   struct kthread *jkt;
-  for (p = proc; p < &proc[NPROC]; p++)
-  {
-    for (jkt = p->kthread; jkt < &p->kthread[NKT]; jkt++)
-    {
-      acquire(&jkt->lock);
-      if (jkt->tid == ktid)
-      {
-        goto found;
-      }
-      release(&jkt->lock);
-    }
-  }
+  if ((jkt = findthread(p, ktid)) == 0)
+    return -1; // no matching tid found
 
-  return -1; // no matching tid found
-
-found:
   release(&jkt->lock);
 
   acquire(&wait_lock);
@@ -269,6 +453,14 @@ found:
   for (;;)
   {
     acquire(&jkt->lock);
+    // another joiner may have freed it while we slept, and
+    // the kthread been reused, even by another process.
+    if (jkt->proc != p || jkt->tid != ktid || jkt->tstate == UNUSED)
+    {
+      release(&jkt->lock);
+      release(&wait_lock);
+      return -1;
+    }
     if (jkt->tstate == ZOMBIE)
     {
       if (addr != 0 && copyout(p->pagetable, addr, (char *)&jkt->xstate, sizeof(jkt->xstate)) < 0)
@@ -291,4 +483,70 @@ found:
 
     sleep(jkt, &wait_lock);
   }
-}
\ No newline at end of file
+}
+
+// Translate the user address of a futex word into the channel
+// its waiters sleep on: the physical address of the word, so the
+// key is the same for every kthread sharing p->pagetable.
+// In a shared-memory segment, or a MAP_SHARED region shared by
+// fork(), that is the segment's page, so the key is the same
+// in every process attached and they can wait on each other.
+// The page is faulted in first, and a copy-on-write page is
+// copied, or the key would change under the waiters at the
+// next store; a read-only one never changes.
+// Returns 0 if uaddr is misaligned, or in no heap page or
+// mmap() region.
+static void *
+futex_key(struct proc *p, uint64 uaddr)
+{
+  uint64 va0 = PGROUNDDOWN(uaddr);
+  uint64 pa0;
+
+  if (uaddr % sizeof(int) != 0 || uaddr >= MAXVA)
+    return 0;
+  if (vmfault(p, va0, PROT_WRITE) < 0 && vmfault(p, va0, PROT_READ) < 0)
+    return 0;
+  if ((pa0 = walkaddr(p->pagetable, va0)) == 0)
+    return 0;
+  return (void *)(pa0 + (uaddr - va0));
+}
+
+// Sleep until woken by futex_wake() on uaddr, provided that
+// the int at uaddr still holds val; the check and going to
+// sleep are atomic with respect to futex_wake().
+// Returns 0 once woken, -1 if the value differed or on error.
+int futex_wait(uint64 uaddr, int val)
+{
+  struct proc *p = myproc();
+  int *key;
+
+  if ((key = futex_key(p, uaddr)) == 0)
+    return -1;
+
+  acquire(&futex_lock);
+  if (*key != val || killed(p) || kthread_killed(mykthread()))
+  {
+    release(&futex_lock);
+    return -1;
+  }
+  sleep(key, &futex_lock);
+  release(&futex_lock);
+  return 0;
+}
+
+// Wake up to n kthreads waiting in futex_wait() on uaddr.
+// Returns the number woken, or -1 on error.
+int futex_wake(uint64 uaddr, int n)
+{
+  struct proc *p = myproc();
+  void *key;
+  int woken;
+
+  if ((key = futex_key(p, uaddr)) == 0 || n < 0)
+    return -1;
+
+  acquire(&futex_lock);
+  woken = wakeup_n(key, n);
+  release(&futex_lock);
+  return woken;
+}
@@ -1,5 +1,9 @@
+#include "schedstat.h"
+
 enum threadstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+struct sleepq;
+
 // Saved registers for kernel context switches.
 struct context {
   uint64 ra;
@@ -26,6 +30,26 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+
+  struct spinlock rqlock;     // protects the run queue fields below.
+  struct kthread *rqhead[NMLFQ]; // RUNNABLE kthreads waiting for this cpu,
+  struct kthread *rqtail[NMLFQ]; // one queue per priority level.
+  int nrunnable;              // Length of the run queues together.
+  uint boostepoch;            // ticks/MLFQBOOST when the queues were last boosted.
+  uint64 minvruntime;         // SCHED_CFS: least vruntime queued or running here; never decreases.
+
+  int online;                 // Set once this cpu has entered scheduler().
+  int idle;                   // In wfi, or about to be; wake it with an IPI.
+  uint64 timerticks;          // Timer interrupts handled, see devintr().
+  int inuser;                 // Running user code, see tlbshootdown().
+  uint64 nutrap;              // Traps from user space.
+
+  uint64 kstackgen;           // kstackgen when this cpu last flushed its TLB.
+  uint64 nsteals;             // kthreads taken from other cpus' queues.
+  uint64 nmigrations;         // Dispatches of a kthread that last ran elsewhere.
+  uint64 idletime;            // time CSR cycles spent with nothing to run.
+  uint64 nswtch;              // kthreads dispatched.
+  uint64 lathist[NLATHIST];   // wakeup-to-run latency, see schedstat.h.
 };
 
 extern struct cpu cpus[NCPU];
@@ -81,16 +105,62 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
+// trapframes are packed TFPERPAGE to a page; a process
+// needs at most NTFPAGE pages of them.
+#define TFPERPAGE (PGSIZE / sizeof(struct trapframe))
+#define NTFPAGE ((NKT + TFPERPAGE - 1) / TFPERPAGE)
+
+// affinity mask allowing every cpu.
+#define AFFINITY_ALL ((1 << NCPU) - 1)
+
+// ticks a kthread may run at MLFQ level l before dropping a level.
+#define MLFQQUANTUM(l) (1 << (l))
+
+// A kthread's place in the timer heap, see hrtimer.c.
+struct hrtimer {
+  uint64 deadline;
+  int idx;                  // position in heap[], or -1
+};
+
 struct kthread
 {
   struct spinlock lock;
-  uint64 kstack;                // Virtual address of kernel stack
+  uint64 kstack;                // Virtual address of kernel stack, or 0 until mapped
   enum threadstate tstate;        // Thread state
   void *chan;                  // If non-zero, sleeping on chan
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int tid;                     // Thread ID
+  int slot;                    // index in proc->kthread[] and of its trapframe
+  struct kthread *tidnext;     // next in proc->tidhash[] chain (proc->tid_lock)
   struct proc *proc;         // thread process
   struct trapframe *trapframe;  // data page for trampoline.S
   struct context context;      // swtch() here to run process
+  int nsleeplock;              // sleeplocks held, see vmcansleep()
+  struct hrtimer timer;        // hrtimersleep() deadline, under timerlock
+
+  int cpu;                     // cpu whose run queue it joins when RUNNABLE
+  int affinity;                // bit i set: may run on cpu i
+  int prio;                    // MLFQ level, 0 is highest
+  int nice;                    // level to start at and return to on a boost
+  int ticks;                   // ticks used at the current level
+  uint epoch;                  // ticks/MLFQBOOST when prio was last reset
+  uint64 runstart;             // SCHED_CFS: time CSR when last charged
+
+  // statistics for schedstat(), under kt->lock:
+  uint64 queuedat;             // time CSR when last made RUNNABLE
+  int woken;                   // ... by a wakeup, rather than yield()
+  uint64 runat;                // time CSR when last dispatched
+  uint64 runwait;              // total time RUNNABLE
+  uint64 cputime;              // total time RUNNING
+  uint64 nvcsw;                // sleep()s
+  uint64 nivcsw;               // yield()s
+  // the run queue lock of rq must be held when using these:
+  struct cpu *rq;              // run queue holding this kthread, or null
+  struct kthread *rqnext;      // next kthread in that run queue
+  int rqlevel;                 // which of rq's queues
+
+  // the lock of the sleep queue of chan must be held when using these:
+  struct sleepq *sq;           // sleep queue holding this kthread, or null
+  struct kthread *sqnext;      // next kthread in that sleep queue
 };
\ No newline at end of file
@@ -20,13 +20,18 @@ void main()
     kvminit();          // create kernel page table
     kvminithart();      // turn on paging
     procinit();         // process table
+    futexinit();        // futex wait/wake
     trapinit();         // trap vectors
+    hrtimerinit();      // deadline timers
+    vdsoinit();         // time page shared with user space
     trapinithart();     // install kernel trap vector
     plicinit();         // set up interrupt controller
     plicinithart();     // ask PLIC for device interrupts
     binit();            // buffer cache
     iinit();            // inode table
     fileinit();         // file table
+    pipeinit();         // pipe object cache
+    shminit();          // shared-memory segments
     virtio_disk_init(); // emulated hard disk
     userinit();         // first user process
     __sync_synchronize();
@@ -27,6 +27,7 @@
 
 // core local interruptor (CLINT), which contains the timer.
 #define CLINT 0x2000000L
+#define CLINT_MSIP(hartid) (CLINT + 4*(hartid)) // write 1 to interrupt hartid.
 #define CLINT_MTIMECMP(hartid) (CLINT + 0x4000 + 8*(hartid))
 #define CLINT_MTIME (CLINT + 0xBFF8) // cycles since boot.
 
@@ -62,6 +63,8 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
-//   TRAPFRAME (kt->trapframe, used by the trampoline)
+//   VDSOPROC, VDSOTIME (see vdso.h)
+//   TRAPFRAME pages (kt->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
-#define TRAPFRAME(kt_idx) (TRAMPOLINE - PGSIZE + (kt_idx * sizeof(struct trapframe)))
+#define TFPAGE(n) (TRAMPOLINE - ((n)+1)*PGSIZE)
+#define TRAPFRAME(slot) (TFPAGE((slot) / TFPERPAGE) + ((slot) % TFPERPAGE) * sizeof(struct trapframe))
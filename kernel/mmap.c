@@ -0,0 +1,531 @@
+// mmap() regions.
+//
+// A process's regions sit between the top of its heap and
+// the vdso pages, handed out top-down. Nothing is mapped up
+// front: vmfault() sends faults above p->sz to mmapfault(),
+// which zero-fills a page, or reads it from the file. Dirty
+// pages of a MAP_SHARED file mapping are written back when
+// the region is unmapped, at munmap(), exec() or exit().
+// A region can also map a shared-memory segment (shm.c).
+//
+// p->vmas is guarded by p->vmlock, like the page table, but
+// file I/O sleeps, so it happens with vmlock released.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
+#include "vdso.h"
+
+#define MMAPTOP VDSOPROC
+
+// The region holding va, or 0. Caller holds p->vmlock.
+static struct vma *
+findvma(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vmas; v < &p->vmas[NVMA]; v++)
+    if(v->used && va >= v->addr && va < v->addr + v->len)
+      return v;
+  return 0;
+}
+
+// The lowest address in use by a region, the limit for
+// growing the heap. Caller holds p->vmlock.
+uint64
+mmapfloor(struct proc *p)
+{
+  struct vma *v;
+  uint64 floor = MMAPTOP;
+
+  for(v = p->vmas; v < &p->vmas[NVMA]; v++)
+    if(v->used && v->addr < floor)
+      floor = v->addr;
+  return floor;
+}
+
+// Map len bytes of f from off, or of segment shm, or zeros
+// if both are 0, into the current process. The region takes
+// over the caller's reference to shm. Returns the address,
+// or -1.
+uint64
+mmap(uint64 len, int prot, int flags, struct file *f, uint64 off, struct shm *shm)
+{
+  struct proc *p = myproc();
+  struct vma *v, *w, *free = 0;
+  uint64 top = MMAPTOP;
+  int moved;
+
+  len = PGROUNDUP(len);
+  if(len == 0 || len > MMAPTOP)
+    return -1;
+
+  acquire(&p->vmlock);
+  if(p->mmapclosed){
+    release(&p->vmlock);
+    return -1;
+  }
+  for(v = p->vmas; v < &p->vmas[NVMA]; v++)
+    if(!v->used && free == 0)
+      free = v;
+  // the highest gap big enough, below every region that
+  // would overlap it.
+  do {
+    moved = 0;
+    for(w = p->vmas; w < &p->vmas[NVMA]; w++){
+      if(w->used && w->addr < top && (top < len || top - len < w->addr + w->len)){
+        top = w->addr;
+        moved = 1;
+      }
+    }
+  } while(moved);
+  if(free == 0 || top < len || top - len < PGROUNDUP(p->sz)){
+    release(&p->vmlock);
+    return -1;
+  }
+
+  free->used = 1;
+  free->addr = top - len;
+  free->len = len;
+  free->prot = prot;
+  free->flags = flags;
+  free->f = f ? filedup(f) : 0;
+  free->off = off;
+  free->shm = shm;
+  release(&p->vmlock);
+  return free->addr;
+}
+
+// The PTE permissions for a page of v.
+static int
+vmaperm(struct vma *v)
+{
+  int perm = PTE_U;
+
+  if(v->prot & PROT_READ)
+    perm |= PTE_R;
+  if(v->prot & PROT_WRITE)
+    perm |= PTE_R | PTE_W;
+  if(v->prot & PROT_EXEC)
+    perm |= PTE_X;
+  return perm;
+}
+
+// Resolve a fault at va, above the heap, for a write if
+// write is set. Returns 0 if the access can be retried, -1
+// if va is in no region or the region forbids the access.
+int
+mmapfault(struct proc *p, uint64 va, int write)
+{
+  struct vma *v;
+  struct file *f = 0;
+  pte_t *pte;
+  uint64 off, old;
+  char *mem;
+  int perm, r;
+  // reading the file sleeps; sys_read() and sys_write()
+  // fault their buffers in first with vmprefault().
+  int cansleep = vmcansleep();
+
+  va = PGROUNDDOWN(va);
+  acquire(&p->vmlock);
+  if((v = findvma(p, va)) == 0 ||
+     (write && (v->prot & PROT_WRITE) == 0) ||
+     (v->prot & (PROT_READ|PROT_WRITE|PROT_EXEC)) == 0){
+    release(&p->vmlock);
+    return -1;
+  }
+  pte = walk(p->pagetable, va, 0);
+  if(pte && (*pte & PTE_V)){
+    // another kthread got here first, or a store to a
+    // copy-on-write page of a MAP_PRIVATE region.
+    old = 0;
+    r = write ? uvmcow(p->pagetable, va, &old) : 0;
+    release(&p->vmlock);
+    if(old){
+      tlbshootdown(p);
+      kfree((void*)old);
+    }
+    return r;
+  }
+  perm = vmaperm(v);
+  off = v->off + (va - v->addr);
+  if(v->shm){
+    // the segment's page, shared with everyone attached.
+    r = -1;
+    if((mem = (char*)shmpage(v->shm, off / PGSIZE)) != 0 &&
+       (r = mappages(p->pagetable, va, PGSIZE, (uint64)mem, perm)) != 0)
+      kfree(mem);
+    release(&p->vmlock);
+    return r;
+  }
+  if(v->f && !cansleep){
+    release(&p->vmlock);
+    return -1;
+  }
+  if(v->f)
+    f = filedup(v->f);
+  release(&p->vmlock);
+
+  if((mem = kalloc_zeroed()) != 0 && f){
+    ilock(f->ip);
+    readi(f->ip, 0, (uint64)mem, off, PGSIZE);
+    iunlock(f->ip);
+  }
+  if(f)
+    fileclose(f);
+  if(mem == 0)
+    return -1;
+
+  r = 0;
+  acquire(&p->vmlock);
+  pte = walk(p->pagetable, va, 0);
+  if(findvma(p, va) == 0 || (pte && (*pte & PTE_V))){
+    // unmapped meanwhile, or mapped by another kthread.
+    r = findvma(p, va) ? 0 : -1;
+    kfree(mem);
+  } else if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, perm) != 0){
+    kfree(mem);
+    r = -1;
+  }
+  release(&p->vmlock);
+  return r;
+}
+
+// Write the dirty pages of [start, end) in v back to its
+// file, if v is a shared mapping of one.
+static void
+writeback(struct proc *p, struct vma *v, uint64 start, uint64 end)
+{
+  struct file *f = v->f;
+  struct inode *ip;
+  pte_t *pte;
+  uint64 a, pa, off;
+  uint n;
+
+  if(f == 0 || (v->flags & MAP_SHARED) == 0 || !f->writable)
+    return;
+  ip = f->ip;
+  for(a = start; a < end; a += PGSIZE){
+    // hold a reference, so the page stays put while
+    // the write sleeps without vmlock.
+    pa = 0;
+    acquire(&p->vmlock);
+    pte = walk(p->pagetable, a, 0);
+    if(pte && (*pte & PTE_V) && (*pte & PTE_D)){
+      *pte &= ~PTE_D;
+      pa = PTE2PA(*pte);
+      kref((void*)pa);
+    }
+    release(&p->vmlock);
+    if(pa == 0)
+      continue;
+
+    off = v->off + (a - v->addr);
+    begin_op();
+    ilock(ip);
+    // write no further than the end of the file.
+    if(off < ip->size){
+      n = ip->size - off < PGSIZE ? ip->size - off : PGSIZE;
+      writei(ip, 0, pa, off, n);
+    }
+    iunlock(ip);
+    end_op();
+    kfree((void*)pa);
+  }
+}
+
+// Remove the pages of [start, end) from p's page table, and
+// free them once no other cpu's TLB can reach them. Holding
+// p->vmlock throughout keeps faults from mapping anything
+// new there meanwhile. Caller holds p->vmlock.
+static void
+vmaclear(struct proc *p, uint64 start, uint64 end)
+{
+  uint64 pa[32], a;
+  pte_t *pte;
+  int n;
+
+  for(a = start; a < end; ){
+    n = 0;
+    for(; a < end && n < NELEM(pa); a += PGSIZE){
+      if((pte = walk(p->pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0)
+        continue;
+      pa[n++] = PTE2PA(*pte);
+      *pte = 0;
+    }
+    if(n > 0)
+      tlbshootdown(p);
+    while(n > 0)
+      kfree((void*)pa[--n]);
+  }
+}
+
+// Does v still cover [start, end)? Caller holds p->vmlock.
+static int
+vmacovers(struct vma *v, uint64 start, uint64 end)
+{
+  return v->used && v->addr <= start && end <= v->addr + v->len;
+}
+
+// Unmap [start, end) of region v, which must cover it.
+// Another kthread may unmap the same range meanwhile, so
+// this rechecks that under p->vmlock, and does nothing if
+// it no longer holds. Returns -1 if unmapping would split v
+// and no region is free.
+static int
+vmaunmap(struct proc *p, struct vma *v, uint64 start, uint64 end)
+{
+  struct vma *w = 0, old;
+  struct file *f = 0;
+  struct shm *shm = 0;
+  uint64 vend;
+
+  acquire(&p->vmlock);
+  if(!vmacovers(v, start, end)){
+    release(&p->vmlock);
+    return 0;
+  }
+  if(start > v->addr && end < v->addr + v->len){
+    for(w = p->vmas; w < &p->vmas[NVMA] && w->used; w++)
+      ;
+    if(w == &p->vmas[NVMA]){
+      release(&p->vmlock);
+      return -1;
+    }
+    w->used = 1;   // reserve it, covering nothing yet
+    w->addr = MMAPTOP;
+    w->len = 0;
+  }
+  // writeback() sleeps, so it works from a copy of v.
+  old = *v;
+  if(old.f)
+    filedup(old.f);
+  release(&p->vmlock);
+
+  writeback(p, &old, start, end);
+  if(old.f)
+    fileclose(old.f);
+
+  acquire(&p->vmlock);
+  vend = v->addr + v->len;
+  if(!vmacovers(v, start, end) ||
+     (w == 0 && start > v->addr && end < vend)){
+    // changed meanwhile; munmap() looks again.
+    if(w)
+      w->used = 0;
+    release(&p->vmlock);
+    return 0;
+  }
+  vmaclear(p, start, end);
+  if(start == v->addr && end == vend){
+    f = v->f;
+    shm = v->shm;
+    v->used = 0;
+  } else if(start == v->addr){
+    v->off += end - start;
+    v->addr = end;
+    v->len = vend - end;
+  } else if(end == vend){
+    v->len = start - v->addr;
+  } else {
+    *w = *v;
+    w->addr = end;
+    w->len = vend - end;
+    w->off = v->off + (end - v->addr);
+    if(w->f)
+      filedup(w->f);
+    if(w->shm)
+      shmdup(w->shm);
+    v->len = start - v->addr;
+  }
+  if(w && w->len == 0)
+    w->used = 0;   // v shrank meanwhile; the split was not needed
+  release(&p->vmlock);
+
+  if(f)
+    fileclose(f);
+  if(shm)
+    shmput(shm);
+  return 0;
+}
+
+// Unmap [addr, addr+len) of the current process, from any
+// regions it overlaps. Returns 0, or -1 on a bad range.
+int
+munmap(uint64 addr, uint64 len)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 end, s, e;
+
+  len = PGROUNDUP(len);
+  end = addr + len;
+  if(addr % PGSIZE != 0 || len == 0 || end < addr || end > MMAPTOP)
+    return -1;
+
+  for(;;){
+    acquire(&p->vmlock);
+    for(v = p->vmas; v < &p->vmas[NVMA]; v++)
+      if(v->used && v->addr < end && addr < v->addr + v->len)
+        break;
+    if(v == &p->vmas[NVMA]){
+      release(&p->vmlock);
+      return 0;
+    }
+    s = v->addr > addr ? v->addr : addr;
+    e = v->addr + v->len < end ? v->addr + v->len : end;
+    release(&p->vmlock);
+    if(vmaunmap(p, v, s, e) < 0)
+      return -1;
+  }
+}
+
+// Does v's page at a need to be mapped before fork() so it
+// can be shared? Not for a segment, whose untouched pages are
+// shared through shmpage(). Caller holds p->vmlock.
+static int
+needshare(struct proc *p, struct vma *v, uint64 a)
+{
+  pte_t *pte;
+
+  if(!v->used || (v->flags & MAP_SHARED) == 0 || v->shm ||
+     (v->prot & (PROT_READ|PROT_WRITE|PROT_EXEC)) == 0)
+    return 0;
+  pte = walk(p->pagetable, a, 0);
+  return pte == 0 || (*pte & PTE_V) == 0;
+}
+
+// Fault in the untouched pages of p's shared file mappings
+// before fork(), which cannot once it holds p->vmlock: a
+// page first read afterwards would be the child's own copy.
+// Returns -1 if that fails.
+int
+mmapshare(struct proc *p)
+{
+  struct vma *v;
+  uint64 off, a;
+  int need;
+
+  for(v = p->vmas; v < &p->vmas[NVMA]; v++){
+    for(off = 0; ; off += PGSIZE){
+      acquire(&p->vmlock);
+      if(!v->used || v->f == 0 || off >= v->len){
+        release(&p->vmlock);
+        break;
+      }
+      a = v->addr + off;
+      need = needshare(p, v, a);
+      release(&p->vmlock);
+      if(need && mmapfault(p, a, 0) < 0)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+// Give child np its own view of p's regions: MAP_SHARED pages
+// are shared outright, MAP_PRIVATE ones copy-on-write. The
+// untouched pages of an anonymous MAP_SHARED region are
+// allocated first, or each process would get its own; those
+// of a file mapping mmapshare() read in.
+// Caller holds p->vmlock. Returns 0, or -1 if out of memory.
+int
+mmapfork(struct proc *p, struct proc *np)
+{
+  struct vma *v;
+  uint64 a;
+  char *mem;
+
+  for(v = p->vmas; v < &p->vmas[NVMA]; v++){
+    for(a = v->addr; a < v->addr + v->len; a += PGSIZE){
+      if(!needshare(p, v, a))
+        continue;
+      // a file page missing means a racing munmap()/mmap().
+      if(v->f || (mem = kalloc_zeroed()) == 0)
+        return -1;
+      if(mappages(p->pagetable, a, PGSIZE, (uint64)mem, vmaperm(v)) != 0){
+        kfree(mem);
+        return -1;
+      }
+    }
+  }
+  for(v = p->vmas; v < &p->vmas[NVMA]; v++){
+    if(v->used &&
+       uvmcopy(p->pagetable, np->pagetable, v->addr, v->len,
+               v->flags & MAP_SHARED) < 0){
+      while(--v >= p->vmas)
+        if(v->used)
+          uvmunmap(np->pagetable, v->addr, v->len / PGSIZE, 1);
+      return -1;
+    }
+  }
+  for(int i = 0; i < NVMA; i++){
+    np->vmas[i] = p->vmas[i];
+    if(np->vmas[i].used && np->vmas[i].f)
+      filedup(np->vmas[i].f);
+    if(np->vmas[i].used && np->vmas[i].shm)
+      shmdup(np->vmas[i].shm);
+  }
+  return 0;
+}
+
+// Unmap all of p's regions, writing back shared file pages,
+// when it exits or execs. Other kthreads may still be running,
+// so mmap() is refused from now on (exec() allows it again),
+// and regions a racing munmap() splits off are unmapped too.
+void
+mmapexit(struct proc *p)
+{
+  struct vma *v;
+  uint64 addr, end;
+
+  acquire(&p->vmlock);
+  p->mmapclosed = 1;
+  release(&p->vmlock);
+  for(;;){
+    acquire(&p->vmlock);
+    for(v = p->vmas; v < &p->vmas[NVMA]; v++)
+      if(v->used && v->len > 0)
+        break;
+    if(v == &p->vmas[NVMA]){
+      release(&p->vmlock);
+      return;
+    }
+    addr = v->addr;
+    end = v->addr + v->len;
+    release(&p->vmlock);
+    vmaunmap(p, v, addr, end);
+  }
+}
+
+// Drop what is left of dead process p's regions, without
+// writing back: a kthread may have raced mmapexit(). Their
+// files go in files[NVMA], for the caller to fileclose()
+// once it holds no spinlocks. Returns how many.
+int
+mmapreap(struct proc *p, struct file **files)
+{
+  struct vma *v;
+  int n = 0;
+
+  for(v = p->vmas; v < &p->vmas[NVMA]; v++){
+    if(!v->used)
+      continue;
+    uvmunmap(p->pagetable, v->addr, v->len / PGSIZE, 1);
+    if(v->f)
+      files[n++] = v->f;
+    if(v->shm)
+      shmput(v->shm);
+    v->used = 0;
+  }
+  return n;
+}
@@ -1,7 +1,22 @@
 #define NPROC        64  // maximum number of processes
-#define NKT           10  // maximum number of kernel threads
+#define NKT           32  // maximum number of kernel threads per process
+#define NTHREAD  (2*NPROC)  // kernel threads in the system-wide pool
+#define KBATCH       32  // pages moved at once between a CPU's free list and the pool
+#define KMAXORDER    10  // largest kallocpages() block is 2^KMAXORDER pages
+#define KZEROPOOL   128  // pages idle CPUs keep zeroed for kalloc_zeroed()
+#define NTIDHASH     16  // buckets in each process's tid index
 #define NCPU          8  // maximum number of CPUs
+#define NSCRATCH     10  // words of machine-mode scratch per CPU (start.c)
+#define TIMEBASE 10000000  // time CSR ticks per second (qemu virt)
+#define TICKCYCLES 1000000 // time CSR ticks per clock tick
+#define NSLEEPQ      64  // buckets in the sleep channel hash table
+#define NMLFQ         4  // scheduler priority levels
+#define MLFQBOOST   100  // ticks between priority boosts
 #define NOFILE       16  // open files per process
+#define NVMA         16  // mmap() regions per process
+#define NEXECSEG     8   // program segments exec() records for paging in
+#define NSHM         16  // shared-memory segments per system
+#define SHMMAXPAGES 512  // pages in a segment: one page of their addresses
 #define NFILE       100  // open files per system
 #define NINODE       50  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
@@ -5,6 +5,8 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "vdso.h"
+#include "fcntl.h"
 
 struct cpu cpus[NCPU];
 
@@ -27,25 +29,7 @@ extern char trampoline[]; // trampoline.S
 // must be acquired before any p->lock.
 struct spinlock wait_lock;
 
-// Allocate a page for each process's kernel stack.
-// Map it high in memory, followed by an invalid
-// guard page.
-void proc_mapstacks(pagetable_t kpgtbl)
-{
-  struct proc *p;
-
-  for (p = proc; p < &proc[NPROC]; p++)
-  {
-    for (struct kthread *kt = p->kthread; kt < &p->kthread[NKT]; kt++)
-    {
-      char *pa = kalloc();
-      if (pa == 0)
-        panic("kalloc");
-      uint64 va = KSTACK((int)((p - proc) * NKT + (kt - p->kthread)));
-      kvmmap(kpgtbl, va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
-    }
-  }
-}
+extern struct kthread kthreads[NTHREAD];
 
 // initialize the proc table.
 void procinit(void)
@@ -55,11 +39,19 @@ void procinit(void)
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
   initlock(&join_lock, "join_lock");
+  for (struct cpu *c = cpus; c < &cpus[NCPU]; c++)
+    initlock(&c->rqlock, "runq");
+  sleepqinit();
+  kthreadinit();
+  if (TFPAGE(NTFPAGE - 1) <= VDSOTIME)
+    panic("procinit: trapframes overlap vdso");
   for (p = proc; p < &proc[NPROC]; p++)
   {
     initlock(&p->lock, "proc");
+    initlock(&p->tid_lock, "nexttid");
+    initlock(&p->vmlock, "vm");
+    initlock(&p->cfslock, "cfs");
     p->state = UNUSEDPROC;
-    kthreadinit(p);
   }
 }
 
@@ -130,14 +122,16 @@ found:
   p->next_tid = 1;
   p->pid = allocpid();
   p->state = USEDPROC;
+  p->vruntime = 0;
 
-  // Allocate a trapframe page.
-  if ((p->base_trapframes = (struct trapframe *)kalloc()) == 0)
+  // The page of counters the process can read.
+  if ((p->vproc = (struct vdsoproc *)kalloc_zeroed()) == 0)
   {
     freeproc(p);
     release(&p->lock);
     return 0;
   }
+  p->vproc->pid = p->pid;
 
   // An empty user page table.
   p->pagetable = proc_pagetable(p);
@@ -148,6 +142,8 @@ found:
     return 0;
   }
 
+  // The first kthread, which also allocates and maps
+  // the first trapframe page.
   struct kthread *kt = allocthread(p);
   if (kt == 0)
   {
@@ -156,10 +152,6 @@ found:
     return 0;
   }
 
-  // when allocating a thread from within a process allocation,
-  // we can safely override the first kthread array entry
-  // p->kthread[0] = *kt;
-
   return kt;
 }
 
@@ -171,16 +163,27 @@ freeproc(struct proc *p)
 {
   struct kthread *kt;
 
-  if (p->base_trapframes)
-    kfree((void *)p->base_trapframes);
-  p->base_trapframes = 0;
+  for (int i = 0; i < NKT; i++)
+  {
+    if ((kt = p->kthread[i]) == 0)
+      continue;
+    acquire(&kt->lock);
+    if (kt->proc == p)
+      freethread(kt);
+    release(&kt->lock);
+  }
+
   if (p->pagetable)
     proc_freepagetable(p->pagetable, p->sz);
-
-  for (kt = p->kthread; kt < &p->kthread[NKT]; kt++)
+  for (int i = 0; i < NTFPAGE; i++)
   {
-    freethread(kt);
+    if (p->trapframes[i])
+      kfree((void *)p->trapframes[i]);
+    p->trapframes[i] = 0;
   }
+  if (p->vproc)
+    kfree((void *)p->vproc);
+  p->vproc = 0;
 
   p->next_tid = 0;
   p->state = UNUSEDPROC;
@@ -190,11 +193,12 @@ freeproc(struct proc *p)
   p->parent = 0;
   p->sz = 0;
   p->pagetable = 0;
+  p->mmapclosed = 0;
   p->name[0] = 0;
 }
 
 // Create a user page table for a given process, with no user memory,
-// but with trampoline and trapframe pages.
+// but with trampoline and the trapframe pages the process has so far.
 pagetable_t
 proc_pagetable(struct proc *p)
 {
@@ -216,25 +220,50 @@ proc_pagetable(struct proc *p)
     return 0;
   }
 
-  // map the trapframe page just below the trampoline page, for
-  // trampoline.S.
-  if (mappages(pagetable, TRAPFRAME(0), PGSIZE,
-               (uint64)(p->base_trapframes), PTE_R | PTE_W) < 0)
+  // map the vdso pages, read-only to the user.
+  if (mappages(pagetable, VDSOTIME, PGSIZE,
+               (uint64)vdsotime, PTE_R | PTE_U) < 0 ||
+      mappages(pagetable, VDSOPROC, PGSIZE,
+               (uint64)p->vproc, PTE_R | PTE_U) < 0)
   {
-    uvmunmap(pagetable, TRAMPOLINE, 1, 0);
-    uvmfree(pagetable, 0);
+    proc_freepagetable(pagetable, 0);
     return 0;
   }
 
+  // map the trapframe pages just below the trampoline page, for
+  // trampoline.S. allocthread() maps any further ones.
+  for (int i = 0; i < NTFPAGE; i++)
+  {
+    if (p->trapframes[i] == 0)
+      continue;
+    if (mappages(pagetable, TFPAGE(i), PGSIZE,
+                 (uint64)(p->trapframes[i]), PTE_R | PTE_W) < 0)
+    {
+      proc_freepagetable(pagetable, 0);
+      return 0;
+    }
+  }
+
   return pagetable;
 }
 
 // Free a process's page table, and free the
-// physical memory it refers to.
+// physical memory it refers to. The trapframe
+// pages belong to the proc and are not freed.
 void proc_freepagetable(pagetable_t pagetable, uint64 sz)
 {
+  pte_t *pte;
+
   uvmunmap(pagetable, TRAMPOLINE, 1, 0);
-  uvmunmap(pagetable, TRAPFRAME(0), 1, 0);
+  if ((pte = walk(pagetable, VDSOTIME, 0)) != 0 && (*pte & PTE_V))
+    uvmunmap(pagetable, VDSOTIME, 1, 0);
+  if ((pte = walk(pagetable, VDSOPROC, 0)) != 0 && (*pte & PTE_V))
+    uvmunmap(pagetable, VDSOPROC, 1, 0);
+  for (int i = 0; i < NTFPAGE; i++)
+  {
+    if ((pte = walk(pagetable, TFPAGE(i), 0)) != 0 && (*pte & PTE_V))
+      uvmunmap(pagetable, TFPAGE(i), 1, 0);
+  }
   uvmfree(pagetable, sz);
 }
 
@@ -254,8 +283,10 @@ uchar initcode[] = {
 void userinit(void)
 {
   struct proc *p;
+  struct kthread *kt;
 
-  p = allocproc()->proc;
+  kt = allocproc();
+  p = kt->proc;
   initproc = p;
 
   // allocate one user page and copy initcode's instructions
@@ -264,41 +295,161 @@ void userinit(void)
   p->sz = PGSIZE;
 
   // prepare for the very first "return" from kernel to user.
-  p->kthread[0].trapframe->epc = 0;     // user program counter
-  p->kthread[0].trapframe->sp = PGSIZE; // user stack pointer
+  kt->trapframe->epc = 0;     // user program counter
+  kt->trapframe->sp = PGSIZE; // user stack pointer
 
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->kthread[0].tstate = RUNNABLE;
+  setrunnable(kt);
 
-  release(&p->kthread[0].lock);
+  release(&kt->lock);
   release(&p->lock);
 }
 
 // Grow or shrink user memory by n bytes.
+// Growing only reserves the addresses; vmfault() allocates
+// each page when it is first touched.
 // Return 0 on success, -1 on failure.
 int growproc(int n)
 {
   uint64 sz;
   struct proc *p = myproc();
 
+  acquire(&p->vmlock);
   sz = p->sz;
   if (n > 0)
   {
-    if ((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0)
+    if (sz + n > mmapfloor(p))
     {
+      release(&p->vmlock);
       return -1;
     }
+    sz += n;
   }
   else if (n < 0)
   {
     sz = uvmdealloc(p->pagetable, sz, sz + n);
   }
   p->sz = sz;
+  release(&p->vmlock);
   return 0;
 }
 
+// Resolve a page fault at user address va in p, for an
+// access of type access (PROT_READ, PROT_WRITE or PROT_EXEC):
+// load a page of the program exec() left unmapped
+// (execfault()), allocate a heap page growproc() left
+// unmapped, or copy a copy-on-write one. Faults above the
+// heap are for mmapfault(). Returns 0 if the access can be
+// retried, -1 if it is a real fault, as when the page is
+// mapped but without that access. Also used by copyin()
+// and copyout(), which walk the page table themselves.
+int vmfault(struct proc *p, uint64 va, int access)
+{
+  int write = (access == PROT_WRITE);
+  uint64 old = 0;
+  pte_t *pte;
+  int r;
+
+  // a page of the program, once loaded, is no different
+  // from a heap page: text pages are not writable, so
+  // uvmcow() refuses stores to those.
+  if (va < p->sz && execfault(p, va) < 0)
+    return -1;
+
+  acquire(&p->vmlock);
+  if (va >= p->sz)
+  {
+    release(&p->vmlock);
+    r = mmapfault(p, va, write);
+  }
+  else
+  {
+    r = uvmlazy(p->pagetable, PGROUNDDOWN(va));
+    if (r == 0 && write)
+      r = uvmcow(p->pagetable, PGROUNDDOWN(va), &old);
+    release(&p->vmlock);
+  }
+  if (old)
+  {
+    tlbshootdown(p);
+    kfree((void *)old);
+  }
+  if (r < 0)
+    return -1;
+
+  // the page is there now; retrying is no use if it was
+  // there all along, without the access.
+  acquire(&p->vmlock);
+  pte = walk(p->pagetable, PGROUNDDOWN(va), 0);
+  if (pte == 0 || (*pte & (PTE_V | PTE_U)) != (PTE_V | PTE_U) ||
+      ((access & PROT_READ) && (*pte & PTE_R) == 0) ||
+      ((access & PROT_WRITE) && (*pte & PTE_W) == 0) ||
+      ((access & PROT_EXEC) && (*pte & PTE_X) == 0))
+    r = -1;
+  release(&p->vmlock);
+  return r;
+}
+
+// Can a page fault taken now sleep to read the page in?
+// Not in a copyin() or copyout() made with a spinlock held,
+// as by piperead(), which turns interrupts off, nor with a
+// sleeplock held, as by readi(): the read may need that very
+// inode or buffer. usertrap() turns interrupts on for faults
+// from user space.
+int vmcansleep(void)
+{
+  struct kthread *kt = mykthread();
+
+  return intr_get() && (kt == 0 || kt->nsleeplock == 0);
+}
+
+// Fault in the unmapped pages of [addr, addr+n) of the
+// current process before a system call copies to or from
+// them with a lock held, since loading a page of the program
+// or of a file mapping sleeps; see vmcansleep().
+void vmprefault(uint64 addr, int n, int write)
+{
+  struct proc *p = myproc();
+  uint64 a;
+
+  if (n <= 0 || addr + n < addr)
+    return;
+  for (a = PGROUNDDOWN(addr); a < addr + n && a < MAXVA; a += PGSIZE)
+    if (walkaddr(p->pagetable, a) == 0)
+      vmfault(p, a, write ? PROT_WRITE : PROT_READ);
+}
+
+// Wait until no other cpu can hold a TLB entry for p's
+// page table from before the caller revoked write access
+// to some pages, or unmapped or replaced them. Entering and
+// leaving the kernel both flush the TLB (trampoline.S), so
+// only cpus running one of p's kthreads in user space
+// matter: send each an IPI and wait to see it trap. Those
+// cpus need no lock to do so, so the caller may hold some,
+// as copyout() from piperead() does.
+void tlbshootdown(struct proc *p)
+{
+  struct cpu *c;
+  struct kthread *kt;
+  uint64 n;
+
+  for (c = cpus; c < &cpus[NCPU]; c++)
+  {
+    kt = *(struct kthread *volatile *)&c->thread;
+    if (kt == 0 || kt == mykthread() || kt->proc != p)
+      continue;
+    n = c->nutrap;
+    __sync_synchronize();
+    if (!*(volatile int *)&c->inuser)
+      continue;
+    *(volatile uint32 *)CLINT_MSIP(c - cpus) = 1;
+    while (*(volatile int *)&c->inuser && *(volatile uint64 *)&c->nutrap == n)
+      ;
+  }
+}
+
 // Create a new process, copying the parent.
 // Sets up child kernel stack to return as if from fork() system call.
 int fork(void)
@@ -309,6 +460,11 @@ int fork(void)
   struct kthread *kt = mykthread();
   struct kthread *nkt;
 
+  // read in what shared file mappings the child must share;
+  // that sleeps, so it comes before taking any locks.
+  if (mmapshare(p) < 0)
+    return -1;
+
   // Allocate process.
   if ((nkt = allocproc()) == 0)
   {
@@ -316,14 +472,25 @@ int fork(void)
   }
   np = nkt->proc;
 
-  // Copy user memory from parent to child.
-  if (uvmcopy(p->pagetable, np->pagetable, p->sz) < 0)
+  // Share user memory with the child, copy-on-write.
+  // np->sz is set first, so freeproc() unmaps the heap
+  // if mmapfork() fails after it was copied.
+  acquire(&p->vmlock);
+  np->sz = p->sz;
+  if (uvmcopy(p->pagetable, np->pagetable, 0, p->sz, 0) < 0 ||
+      mmapfork(p, np) < 0)
   {
+    release(&p->vmlock);
+    release(&nkt->lock);
     freeproc(np);
     release(&np->lock);
     return -1;
   }
-  np->sz = p->sz;
+  memmove(np->segs, p->segs, sizeof(p->segs));
+  np->nseg = p->nseg;
+  np->exeip = p->exeip ? idup(p->exeip) : 0;
+  release(&p->vmlock);
+  np->vruntime = p->vruntime;
 
   // copy saved user registers.
   *(nkt->trapframe) = *(kt->trapframe);
@@ -339,8 +506,12 @@ int fork(void)
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
+  // our other kthreads must not go on writing pages
+  // that are now shared with the child, once it runs.
+  tlbshootdown(p);
+
   pid = np->pid;
-  nkt->tstate = RUNNABLE;
+  setrunnable(nkt);
   release(&nkt->lock);
 
   release(&np->lock);
@@ -375,10 +546,15 @@ void exit(int status)
 {
   struct proc *p = myproc();
   struct kthread *kt = mykthread();
+  struct inode *ip;
 
   if (p == initproc)
     panic("init exiting");
 
+  // Write back and drop mmap() regions while files
+  // can still be written.
+  mmapexit(p);
+
   // Close all open files.
   for (int fd = 0; fd < NOFILE; fd++)
   {
@@ -390,8 +566,16 @@ void exit(int status)
     }
   }
 
+  // other kthreads still running fault in no more of
+  // the program.
+  acquire(&p->vmlock);
+  ip = execdetach(p);
+  release(&p->vmlock);
+
   begin_op();
   iput(p->cwd);
+  if (ip)
+    iput(ip);
   end_op();
   p->cwd = 0;
 
@@ -424,8 +608,9 @@ void exit(int status)
 int wait(uint64 addr)
 {
   struct proc *pp;
-  int havekids, pid;
+  int havekids, pid, nf;
   struct proc *p = myproc();
+  struct file *files[NVMA];
 
   acquire(&wait_lock);
 
@@ -451,9 +636,15 @@ int wait(uint64 addr)
             release(&wait_lock);
             return -1;
           }
+          // its kthreads are gone: drop any region one of
+          // them mapped after mmapexit(), before freeproc()
+          // frees the page table.
+          nf = mmapreap(pp, files);
           freeproc(pp);
           release(&pp->lock);
           release(&wait_lock);
+          while (nf > 0)
+            fileclose(files[--nf]);
           return pid;
         }
         release(&pp->lock);
@@ -472,55 +663,466 @@ int wait(uint64 addr)
   }
 }
 
+// Pick the cpu whose run queue kt should join: the one it
+// last ran on if its affinity allows, else the allowed online
+// cpu with the shortest queue.
+static int
+rqplace(struct kthread *kt)
+{
+  struct cpu *c, *best = 0;
+
+  if (kt->affinity & (1 << kt->cpu))
+    return kt->cpu;
+  for (c = cpus; c < &cpus[NCPU]; c++)
+  {
+    if (!c->online || (kt->affinity & (1 << (c - cpus))) == 0)
+      continue;
+    if (best == 0 || c->nrunnable < best->nrunnable)
+      best = c;
+  }
+  return best ? best - cpus : kt->cpu;
+}
+
+// Multi-level feedback queue. A kthread starts at level
+// kt->nice, drops a level each time it uses up its quantum
+// there (see schedtick()), and every MLFQBOOST ticks goes
+// back to kt->nice. Boosts are applied lazily: to a kthread
+// when it is next queued or dispatched, and to a cpu's
+// queues when it next dequeues.
+
+// With SCHED_CFS (make SCHEDPOLICY=CFS) the levels are unused
+// and everything queues at level 0. Instead each process
+// accumulates virtual runtime: time CSR cycles its kthreads
+// ran, scaled by 1024/CFSWEIGHT(kt->nice). The queued kthread
+// whose process has the least runs next, so fairness is
+// between processes, however many kthreads each has.
+#ifdef SCHED_CFS
+
+#define CFSWEIGHT(nice) (1024 >> (nice))
+#define CFSSLACK 1000000 // vruntime a waking process may be behind (about a tick)
+
+// Charge kt's process for the time since kt->runstart.
+// Caller must hold kt->lock.
+static void
+cfscharge(struct kthread *kt)
+{
+  struct proc *p = kt->proc;
+  uint64 now = r_time();
+
+  acquire(&p->cfslock);
+  p->vruntime += (now - kt->runstart) * 1024 / CFSWEIGHT(kt->nice);
+  release(&p->cfslock);
+  kt->runstart = now;
+}
+
+// Advance c->minvruntime to the least vruntime among the
+// processes queued on c and that of running, if not 0.
+// Caller must hold c->rqlock.
+static void
+cfsminupdate(struct cpu *c, struct kthread *running)
+{
+  uint64 min = running ? running->proc->vruntime : (uint64)-1;
+  struct kthread *it;
+
+  for (it = c->rqhead[0]; it; it = it->rqnext)
+    if (it->proc->vruntime < min)
+      min = it->proc->vruntime;
+  if (min != (uint64)-1 && min > c->minvruntime)
+    c->minvruntime = min;
+}
+
+// Don't let a process that slept for a long time come back
+// so far behind the others on c that it monopolizes c; a
+// little behind, so it runs soon. Caller must hold c->rqlock.
+static void
+cfsplace(struct proc *p, struct cpu *c)
+{
+  acquire(&p->cfslock);
+  if (p->vruntime + CFSSLACK < c->minvruntime)
+    p->vruntime = c->minvruntime - CFSSLACK;
+  release(&p->cfslock);
+}
+
+#else
+
+// Apply any boost kt has missed. Caller must hold kt->lock.
+static void
+mlfqrefresh(struct kthread *kt)
+{
+  uint epoch = ticks / MLFQBOOST;
+
+  if (kt->epoch != epoch)
+  {
+    kt->epoch = epoch;
+    kt->prio = kt->nice;
+    kt->ticks = 0;
+  }
+}
+
+// Move everything queued on c to the top level if a boost
+// happened since c last looked. Caller must hold c->rqlock.
+static void
+rqboost(struct cpu *c)
+{
+  uint epoch = ticks / MLFQBOOST;
+  struct kthread *kt;
+
+  if (c->boostepoch == epoch)
+    return;
+  c->boostepoch = epoch;
+  for (int l = 1; l < NMLFQ; l++)
+  {
+    if (c->rqhead[l] == 0)
+      continue;
+    for (kt = c->rqhead[l]; kt; kt = kt->rqnext)
+      kt->rqlevel = 0;
+    if (c->rqtail[0])
+      c->rqtail[0]->rqnext = c->rqhead[l];
+    else
+      c->rqhead[0] = c->rqhead[l];
+    c->rqtail[0] = c->rqtail[l];
+    c->rqhead[l] = c->rqtail[l] = 0;
+  }
+}
+
+#endif
+
+// Mark kt RUNNABLE and append it to the run queue for its
+// level on the cpu it last ran on (or was placed on by
+// allocthread()), or on another cpu if its affinity no
+// longer allows that one. Caller must hold kt->lock.
+void setrunnable(struct kthread *kt)
+{
+  struct cpu *c;
+  int l;
+
+  kt->woken = (kt->tstate == SLEEPING);
+  kt->queuedat = r_time();
+  kt->tstate = RUNNABLE;
+  kt->cpu = rqplace(kt);
+  c = &cpus[kt->cpu];
+#ifdef SCHED_CFS
+  l = 0;
+#else
+  mlfqrefresh(kt);
+  l = kt->prio;
+#endif
+
+  acquire(&c->rqlock);
+  if (kt->rq == 0)
+  {
+#ifdef SCHED_CFS
+    cfsplace(kt->proc, c);
+#endif
+    kt->rq = c;
+    kt->rqlevel = l;
+    kt->rqnext = 0;
+    if (c->rqtail[l])
+      c->rqtail[l]->rqnext = kt;
+    else
+      c->rqhead[l] = kt;
+    c->rqtail[l] = kt;
+    c->nrunnable++;
+  }
+  release(&c->rqlock);
+
+  // the cpu may be parked in wfi; kick it.
+  if (c != mycpu() && c->idle)
+    *(volatile uint32 *)CLINT_MSIP(c - cpus) = 1;
+}
+
+// Called on each timer interrupt on behalf of the kthread it
+// interrupted. Charges it the tick and returns 1 if it should
+// yield: it has used up its quantum (and drops a level), or a
+// kthread of higher priority is waiting on this cpu.
+int schedtick(void)
+{
+  struct kthread *kt = mykthread();
+  struct cpu *c = mycpu();
+  int preempt = 0;
+
+  acquire(&kt->lock);
+#ifdef SCHED_CFS
+  struct kthread *it;
+
+  // yield to a sibling kthread, or to one whose process
+  // has fallen behind this one.
+  cfscharge(kt);
+  acquire(&c->rqlock);
+  cfsminupdate(c, kt);
+  for (it = c->rqhead[0]; it && !preempt; it = it->rqnext)
+    if (it->proc == kt->proc || it->proc->vruntime < kt->proc->vruntime)
+      preempt = 1;
+  release(&c->rqlock);
+#else
+  mlfqrefresh(kt);
+  if (++kt->ticks >= MLFQQUANTUM(kt->prio))
+  {
+    if (kt->prio < NMLFQ - 1)
+      kt->prio++;
+    kt->ticks = 0;
+    preempt = 1;
+  }
+  // unlocked peek; a stale answer costs one tick.
+  for (int l = 0; l < kt->prio && !preempt; l++)
+    if (c->rqhead[l])
+      preempt = 1;
+#endif
+  release(&kt->lock);
+  return preempt;
+}
+
+// Set the calling kthread's base MLFQ level to its current
+// one plus inc, clamped to the valid levels. Returns the new
+// base level. Under SCHED_CFS it selects the kthread's weight.
+int nice(int inc)
+{
+  struct kthread *kt = mykthread();
+  int n;
+
+  acquire(&kt->lock);
+  n = kt->nice + inc;
+  if (n < 0)
+    n = 0;
+  if (n > NMLFQ - 1)
+    n = NMLFQ - 1;
+  kt->nice = n;
+  if (kt->prio < n)
+    kt->prio = n;
+  release(&kt->lock);
+  return n;
+}
+
+// Take kt off whichever run queue it is on, if any.
+// Used when a RUNNABLE kthread is torn down before
+// it gets to run. Caller must hold kt->lock.
+void rqremove(struct kthread *kt)
+{
+  struct cpu *c;
+  struct kthread *it, *prev;
+  int l;
+
+  while ((c = kt->rq) != 0)
+  {
+    acquire(&c->rqlock);
+    if (kt->rq != c)
+    {
+      // moved to another queue meanwhile; retry there.
+      release(&c->rqlock);
+      continue;
+    }
+    l = kt->rqlevel;
+    prev = 0;
+    for (it = c->rqhead[l]; it != kt; it = it->rqnext)
+      prev = it;
+    if (prev)
+      prev->rqnext = kt->rqnext;
+    else
+      c->rqhead[l] = kt->rqnext;
+    if (c->rqtail[l] == kt)
+      c->rqtail[l] = prev;
+    kt->rq = 0;
+    kt->rqnext = 0;
+    c->nrunnable--;
+    release(&c->rqlock);
+    return;
+  }
+}
+
+// Pop the first kthread that may run on cpu id from the
+// highest non-empty level of c's run queues, or return 0.
+// Affinity is read without kt->lock; scheduler() checks it
+// again once it holds the lock.
+static struct kthread *
+rqdequeue(struct cpu *c, int id)
+{
+  struct kthread *kt = 0, *prev = 0;
+  int l;
+
+  acquire(&c->rqlock);
+#ifdef SCHED_CFS
+  struct kthread *it, *itprev = 0;
+
+  // the kthread whose process has the least vruntime.
+  cfsminupdate(c, 0);
+  for (it = c->rqhead[0]; it; itprev = it, it = it->rqnext)
+  {
+    if ((it->affinity & (1 << id)) == 0)
+      continue;
+    if (kt == 0 || it->proc->vruntime < kt->proc->vruntime)
+    {
+      kt = it;
+      prev = itprev;
+    }
+  }
+  l = 0;
+#else
+  rqboost(c);
+  for (l = 0; l < NMLFQ && kt == 0; l++)
+  {
+    prev = 0;
+    for (kt = c->rqhead[l]; kt; prev = kt, kt = kt->rqnext)
+      if (kt->affinity & (1 << id))
+        break;
+  }
+  l--;
+#endif
+  if (kt)
+  {
+    if (prev)
+      prev->rqnext = kt->rqnext;
+    else
+      c->rqhead[l] = kt->rqnext;
+    if (c->rqtail[l] == kt)
+      c->rqtail[l] = prev;
+    kt->rq = 0;
+    kt->rqnext = 0;
+    c->nrunnable--;
+  }
+  release(&c->rqlock);
+  return kt;
+}
+
+// Called by an idle cpu: take the first kthread allowed on c
+// from the longest run queue among the other cpus, or return 0.
+// The queue lengths are read without locks; a stale guess
+// only costs an empty rqdequeue().
+static struct kthread *
+rqsteal(struct cpu *c)
+{
+  struct cpu *v, *victim = 0;
+  struct kthread *kt;
+
+  for (v = cpus; v < &cpus[NCPU]; v++)
+  {
+    if (v == c || !v->online || v->nrunnable == 0)
+      continue;
+    if (victim == 0 || v->nrunnable > victim->nrunnable)
+      victim = v;
+  }
+  if (victim == 0)
+    return 0;
+
+  if ((kt = rqdequeue(victim, c - cpus)) != 0)
+    c->nsteals++;
+  return kt;
+}
+
+// Charge the time kt spent RUNNABLE as it is dispatched on c.
+// Caller must hold kt->lock.
+static void
+schedaccount(struct cpu *c, struct kthread *kt)
+{
+  uint64 wait;
+  int b;
+
+  kt->runat = r_time();
+  wait = kt->runat - kt->queuedat;
+  kt->runwait += wait;
+  c->nswtch++;
+  if (kt->woken)
+  {
+    for (b = 0; (wait >>= 1) != 0 && b < NLATHIST - 1; b++)
+      ;
+    c->lathist[b]++;
+  }
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run.
-//  - swtch to start running that process.
-//  - eventually that process transfers control
+//  - take the next kthread off this cpu's run queue,
+//    or steal one from the busiest other cpu.
+//  - swtch to start running that kthread.
+//  - eventually that kthread transfers control
 //    via swtch back to the scheduler.
 void scheduler(void)
 {
-  struct proc *p;
   struct kthread *kt;
   struct cpu *c = mycpu();
+  int idle = 0;
+  uint64 idlestart = 0;
 
   c->thread = 0;
+  c->online = 1;
   for (;;)
   {
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
 
-    for (p = proc; p < &proc[NPROC]; p++)
+    if ((kt = rqdequeue(c, cpuid())) == 0 && (kt = rqsteal(c)) == 0)
     {
-      acquire(&p->lock);
-      if (p->state == USEDPROC)
+      if (!idle)
       {
-        release(&p->lock);
-        for (kt = p->kthread; kt < &p->kthread[NKT]; kt++)
-        {
-          acquire(&kt->lock);
-          if (kt->tstate == RUNNABLE)
-          {
-            // Switch to chosen process.  It is the process's job
-            // to release its lock and then reacquire it
-            // before jumping back to us.
-            kt->tstate = RUNNING;
-            c->thread = kt;
-            swtch(&c->context, &kt->context);
-
-            // Process is done running for now.
-            // It should have changed its p->state before coming back.
-            c->thread = 0;
-          }
-          release(&kt->lock);
-        }
+        idle = 1;
+        idlestart = r_time();
       }
-      else
+      // nothing to run: zero a page for kalloc_zeroed() if
+      // it needs one, then look again.
+      if (kzerofill())
+        continue;
+      // park until an interrupt. announce it
+      // first, so that a setrunnable() onto our queue after
+      // the second look below sends an IPI, which keeps wfi
+      // from sleeping. otherwise the next tick wakes us. the
+      // look is a real dequeue, not a count: a queue may hold
+      // only kthreads this cpu may not run.
+      c->idle = 1;
+      __sync_synchronize();
+      if ((kt = rqdequeue(c, cpuid())) == 0 && (kt = rqsteal(c)) == 0)
       {
-        release(&p->lock);
+        wfi();
+        c->idle = 0;
+        continue;
       }
+      c->idle = 0;
+    }
+    if (idle)
+    {
+      c->idletime += r_time() - idlestart;
+      idle = 0;
     }
+
+    acquire(&kt->lock);
+    // the kthread may have been torn down, or queued
+    // again, between rqdequeue() and acquiring its lock.
+    // its affinity may also have changed: send it elsewhere.
+    if (kt->tstate == RUNNABLE && kt->rq == 0 &&
+        (kt->affinity & (1 << cpuid())) == 0)
+    {
+      setrunnable(kt);
+    }
+    else if (kt->tstate == RUNNABLE && kt->rq == 0)
+    {
+      // Switch to chosen thread.  It is the thread's job
+      // to release its lock and then reacquire it
+      // before jumping back to us.
+#ifdef SCHED_CFS
+      kt->runstart = r_time();
+#else
+      mlfqrefresh(kt);
+#endif
+      kt->tstate = RUNNING;
+      schedaccount(c, kt);
+      if (kt->cpu != cpuid())
+        c->nmigrations++;
+      kt->cpu = cpuid();
+      c->thread = kt;
+      kstackfence();
+      swtch(&c->context, &kt->context);
+
+      // Thread is done running for now.
+      // It should have changed its kt->tstate before coming back.
+      c->thread = 0;
+      kt->cputime += r_time() - kt->runat;
+      if (kt->proc)
+        __sync_fetch_and_add(&kt->proc->vproc->cputime, r_time() - kt->runat);
+#ifdef SCHED_CFS
+      if (kt->proc)
+        cfscharge(kt);
+#endif
+    }
+    release(&kt->lock);
   }
 }
 
@@ -555,7 +1157,8 @@ void yield(void)
 {
   struct kthread *kt = mykthread();
   acquire(&kt->lock);
-  kt->tstate = RUNNABLE;
+  kt->nivcsw++;
+  setrunnable(kt);
   sched();
   release(&kt->lock);
 }
@@ -582,29 +1185,98 @@ void forkret(void)
   usertrapret();
 }
 
+// Sleeping kthreads wait on a hash table of sleep queues,
+// keyed by channel, so that wakeup() only looks at threads
+// sleeping on channels that hash to the same bucket rather
+// than locking every kthread in the system.
+// Lock order: kt->lock, then sleepq lock.
+struct sleepq {
+  struct spinlock lock;
+  struct kthread *head;        // FIFO of sleeping kthreads
+  struct kthread *tail;
+} sleepq[NSLEEPQ];
+
+static struct sleepq *
+sleepqof(void *chan)
+{
+  uint64 h = (uint64)chan;
+
+  h ^= h >> 12;
+  return &sleepq[(h >> 3) % NSLEEPQ];
+}
+
+void sleepqinit(void)
+{
+  for (struct sleepq *sq = sleepq; sq < &sleepq[NSLEEPQ]; sq++)
+    initlock(&sq->lock, "sleepq");
+}
+
+// Unlink kt from sq. Caller must hold sq->lock.
+static void
+squnlink(struct sleepq *sq, struct kthread *kt)
+{
+  struct kthread *it, *prev = 0;
+
+  for (it = sq->head; it != kt; it = it->sqnext)
+    prev = it;
+  if (prev)
+    prev->sqnext = kt->sqnext;
+  else
+    sq->head = kt->sqnext;
+  if (sq->tail == kt)
+    sq->tail = prev;
+  kt->sq = 0;
+  kt->sqnext = 0;
+}
+
+// Take kt off the sleep queue of kt->chan, if wakeup()
+// has not done so already. Caller must hold kt->lock.
+void sleepqremove(struct kthread *kt)
+{
+  struct sleepq *sq = sleepqof(kt->chan);
+
+  acquire(&sq->lock);
+  if (kt->sq == sq)
+    squnlink(sq, kt);
+  release(&sq->lock);
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void sleep(void *chan, struct spinlock *lk)
 {
   struct kthread *kt = mykthread();
+  struct sleepq *sq = sleepqof(chan);
 
-  // Must acquire p->lock in order to
-  // change p->state and then call sched.
-  // Once we hold p->lock, we can be
-  // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
-  // so it's okay to release lk.
+  // Must acquire kt->lock in order to
+  // change kt->tstate and then call sched.
+  // Once we are on chan's sleep queue, a wakeup()
+  // will find us and wait for kt->lock before
+  // checking our state, so it's okay to release lk.
 
   acquire(&kt->lock);
+  kt->chan = chan;
+
+  acquire(&sq->lock);
+  kt->sq = sq;
+  kt->sqnext = 0;
+  if (sq->tail)
+    sq->tail->sqnext = kt;
+  else
+    sq->head = kt;
+  sq->tail = kt;
+  release(&sq->lock);
+
   release(lk);
 
   // Go to sleep.
-  kt->chan = chan;
   kt->tstate = SLEEPING;
+  kt->nvcsw++;
 
   sched();
 
-  // Tidy up.
+  // Tidy up. wakeup() unlinked us, but kill() does not.
+  sleepqremove(kt);
   kt->chan = 0;
 
   // Reacquire original lock.
@@ -612,28 +1284,65 @@ void sleep(void *chan, struct spinlock *lk)
   acquire(lk);
 }
 
-// Wake up all processes sleeping on chan.
-// Must be called without any p->lock.
-void wakeup(void *chan)
+// Wake up to n kthreads sleeping on chan, oldest first,
+// or all of them if n < 0. Returns the number woken.
+// Must be called without any kt->lock.
+int wakeup_n(void *chan, int n)
 {
-  struct proc *p;
-  struct kthread *kt;
+  struct sleepq *sq = sleepqof(chan);
+  struct kthread *batch[16], *kt, *next;
+  int i, nbatch, woken = 0;
 
-  for (p = proc; p < &proc[NPROC]; p++)
+  for (;;)
   {
-    for (kt = p->kthread; kt < &p->kthread[NKT]; kt++)
+    // unlink a batch of candidates under the queue lock,
+    // then wake them under their own locks.
+    nbatch = 0;
+    acquire(&sq->lock);
+    for (kt = sq->head; kt && nbatch < NELEM(batch); kt = next)
     {
-      if (kt != mykthread())
+      next = kt->sqnext;
+      if (n >= 0 && woken + nbatch >= n)
+        break;
+      if (kt->chan == chan)
       {
-        acquire(&kt->lock);
-        if (kt->tstate == SLEEPING && kt->chan == chan)
-        {
-          kt->tstate = RUNNABLE;
-        }
-        release(&kt->lock);
+        squnlink(sq, kt);
+        batch[nbatch++] = kt;
+      }
+    }
+    release(&sq->lock);
+
+    for (i = 0; i < nbatch; i++)
+    {
+      kt = batch[i];
+      acquire(&kt->lock);
+      // a killed sleeper may already be running.
+      if (kt->tstate == SLEEPING && kt->chan == chan)
+      {
+        setrunnable(kt);
+        woken++;
       }
+      release(&kt->lock);
     }
+
+    if (nbatch == 0 || (n < 0 && nbatch < NELEM(batch)) || (n >= 0 && woken >= n))
+      break;
   }
+  return woken;
+}
+
+// Wake up all kthreads sleeping on chan.
+// Must be called without any kt->lock.
+void wakeup(void *chan)
+{
+  wakeup_n(chan, -1);
+}
+
+// Wake up the kthread that has slept longest on chan, if any.
+// For channels where any one waiter can make progress.
+void wakeup_one(void *chan)
+{
+  wakeup_n(chan, 1);
 }
 
 // Kill the process with the given pid.
@@ -650,13 +1359,19 @@ int kill(int pid)
     {
       p->killed = 1;
       // Wake process from sleep().
-      for (struct kthread *kt = p->kthread; kt < &p->kthread[NKT]; kt++)
+      for (int i = 0; i < NKT; i++)
       {
+        struct kthread *kt = p->kthread[i];
+        if (kt == 0)
+          continue;
         acquire(&kt->lock);
-        kt->killed = 1;
-        if (kt->tstate == SLEEPING)
+        if (kt->proc == p)
         {
-          kt->tstate = RUNNABLE;
+          kt->killed = 1;
+          if (kt->tstate == SLEEPING)
+          {
+            setrunnable(kt);
+          }
         }
         release(&kt->lock);
       }
@@ -719,6 +1434,103 @@ int either_copyin(void *dst, int user_src, uint64 src, uint64 len)
   }
 }
 
+// Copy up to n scheduler statistics records of the kind
+// selected by what (see schedstat.h) to user address addr.
+// Returns the number copied, or -1.
+int schedstat(int what, uint64 addr, int n)
+{
+  struct cpu *c;
+  struct kthread *kt;
+  struct cpustat cs;
+  struct kthreadstat ks;
+  struct kmemstat ms;
+  struct buddystat bs;
+  struct slabstat ss;
+  int i = 0;
+
+  if (what == SCHEDSTAT_CPU)
+  {
+    for (c = cpus; c < &cpus[NCPU] && i < n; c++)
+    {
+      if (!c->online)
+        continue;
+      // racy snapshot: these counters are only ever
+      // written by c itself.
+      cs.cpu = c - cpus;
+      cs.nrunnable = c->nrunnable;
+      cs.nswtch = c->nswtch;
+      cs.nsteals = c->nsteals;
+      cs.nmigrations = c->nmigrations;
+      cs.idletime = c->idletime;
+      memmove(cs.lathist, c->lathist, sizeof(cs.lathist));
+      if (copyout(myproc()->pagetable, addr + i * sizeof(cs), (char *)&cs, sizeof(cs)) < 0)
+        return -1;
+      i++;
+    }
+    return i;
+  }
+  if (what == SCHEDSTAT_KTHREAD)
+  {
+    for (kt = kthreads; kt < &kthreads[NTHREAD] && i < n; kt++)
+    {
+      acquire(&kt->lock);
+      if (kt->tstate == UNUSED || kt->proc == 0)
+      {
+        release(&kt->lock);
+        continue;
+      }
+      ks.pid = kt->proc->pid;
+      ks.tid = kt->tid;
+      ks.state = kt->tstate;
+      ks.cpu = kt->cpu;
+      safestrcpy(ks.name, kt->proc->name, sizeof(ks.name));
+      ks.runwait = kt->runwait;
+      ks.cputime = kt->cputime;
+      if (kt->tstate == RUNNING)
+        ks.cputime += r_time() - kt->runat;
+      ks.nvcsw = kt->nvcsw;
+      ks.nivcsw = kt->nivcsw;
+      release(&kt->lock);
+      if (copyout(myproc()->pagetable, addr + i * sizeof(ks), (char *)&ks, sizeof(ks)) < 0)
+        return -1;
+      i++;
+    }
+    return i;
+  }
+  if (what == SCHEDSTAT_KMEM)
+  {
+    for (c = cpus; c < &cpus[NCPU] && i < n; c++)
+    {
+      if (!c->online)
+        continue;
+      kmemstat(c - cpus, &ms);
+      if (copyout(myproc()->pagetable, addr + i * sizeof(ms), (char *)&ms, sizeof(ms)) < 0)
+        return -1;
+      i++;
+    }
+    return i;
+  }
+  if (what == SCHEDSTAT_BUDDY)
+  {
+    if (n < 1)
+      return 0;
+    kbuddystat(&bs);
+    if (copyout(myproc()->pagetable, addr, (char *)&bs, sizeof(bs)) < 0)
+      return -1;
+    return 1;
+  }
+  if (what == SCHEDSTAT_SLAB)
+  {
+    for (; i < n && slabstat(i, &ss) == 0; i++)
+    {
+      if (copyout(myproc()->pagetable, addr + i * sizeof(ss), (char *)&ss, sizeof(ss)) < 0)
+        return -1;
+    }
+    return i;
+  }
+  return -1;
+}
+
 // Print a process listing to console.  For debugging.
 // Runs when user types ^P on console.
 // No lock to avoid wedging a stuck machine further.
@@ -729,9 +1541,18 @@ void procdump(void)
       [USEDPROC] "usedproc",
       [ZOMBIEPROC] "zombieproc"};
   struct proc *p;
+  struct cpu *c;
   char *state;
 
   printf("\n");
+  for (c = cpus; c < &cpus[NCPU]; c++)
+  {
+    if (!c->online)
+      continue;
+    printf("cpu %d: runq %d steals %d migrations %d idle %d\n",
+           (int)(c - cpus), c->nrunnable, (int)c->nsteals,
+           (int)c->nmigrations, (int)c->idletime);
+  }
   for (p = proc; p < &proc[NPROC]; p++)
   {
     if (p->state == UNUSEDPROC)
@@ -3,11 +3,36 @@
 enum procstate { UNUSEDPROC, USEDPROC, ZOMBIEPROC };
 
 // Per-process state
+// A region of a process's address space set up by mmap(),
+// above the heap. Pages are faulted in as they are touched.
+struct vma {
+  int used;
+  uint64 addr;                 // page-aligned start
+  uint64 len;                  // a multiple of PGSIZE
+  int prot;                    // PROT_*
+  int flags;                   // MAP_*
+  struct file *f;              // 0 if MAP_ANONYMOUS
+  uint64 off;                  // file offset of addr, or segment offset
+  struct shm *shm;             // shared-memory segment, or 0
+};
+
+// A loadable segment of a process's program, recorded by
+// exec(). Its pages are read from the program file as they
+// are touched; see execfault().
+struct execseg {
+  uint64 va;                   // page-aligned start
+  uint64 memsz;
+  uint64 filesz;               // bytes past this are zero
+  uint64 off;                  // file offset of va
+  int perm;                    // PTE_*
+};
+
 struct proc {
   struct spinlock lock;
 
   int next_tid;
-  struct spinlock tid_lock;
+  struct spinlock tid_lock;    // protects next_tid, kthread[] and tidhash[]
+  struct kthread *tidhash[NTIDHASH];  // tid -> kthread index, chained by tidnext
 
   // p->lock must be held when using these:
   enum procstate state;        // Process state
@@ -15,15 +40,30 @@ struct proc {
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
 
-  struct kthread kthread[NKT];        // kthread group table
-  struct trapframe *base_trapframes;  // data page for trampolines
+  struct spinlock cfslock;     // protects vruntime; taken last
+  uint64 vruntime;             // SCHED_CFS: weighted cpu time of all its kthreads
+  struct vdsoproc *vproc;      // counters page mapped at VDSOPROC
+
+  // tid_lock must be held when changing these:
+  struct kthread *kthread[NKT];           // live kthreads, by slot
+  struct trapframe *trapframes[NTFPAGE];  // trapframe pages, allocated as slots need them
 
   // wait_lock must be held when using this:
   struct proc *parent;         // Parent process
 
-  // these are private to the process, so p->lock need not be held.
+  // vmlock must be held when changing these, since the
+  // process's kthreads may fault or grow memory concurrently:
+  struct spinlock vmlock;
   uint64 sz;                   // Size of process memory (bytes)
   pagetable_t pagetable;       // User page table
+  struct vma vmas[NVMA];       // mmap() regions, see mmap.c
+  int mmapclosed;              // mmapexit() ran, so mmap() fails
+  struct execseg segs[NEXECSEG]; // program segments, see execfault()
+  int nseg;
+  struct inode *exeip;         // program segs are loaded from
+  int nexecio;                 // execfault()s reading exeip
+
+  // these are private to the process, so p->lock need not be held.
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
@@ -256,6 +256,21 @@ r_mcounteren()
   return x;
 }
 
+// Supervisor Counter-Enable
+static inline void
+w_scounteren(uint64 x)
+{
+  asm volatile("csrw scounteren, %0" : : "r" (x));
+}
+
+static inline uint64
+r_scounteren()
+{
+  uint64 x;
+  asm volatile("csrr %0, scounteren" : "=r" (x) );
+  return x;
+}
+
 // machine-mode cycle counter
 static inline uint64
 r_time()
@@ -272,6 +287,13 @@ intr_on()
   w_sstatus(r_sstatus() | SSTATUS_SIE);
 }
 
+// wait for an interrupt; returns once one is pending.
+static inline void
+wfi()
+{
+  asm volatile("wfi");
+}
+
 // disable device interrupts
 static inline void
 intr_off()
@@ -334,6 +356,7 @@ typedef uint64 *pagetable_t; // 512 PTEs
 
 #define PGSIZE 4096 // bytes per page
 #define PGSHIFT 12  // bits of offset within a page
+#define MEGAPGSIZE (PGSIZE*512) // bytes mapped by a level-1 leaf PTE
 
 #define PGROUNDUP(sz)  (((sz)+PGSIZE-1) & ~(PGSIZE-1))
 #define PGROUNDDOWN(a) (((a)) & ~(PGSIZE-1))
@@ -343,6 +366,8 @@ typedef uint64 *pagetable_t; // 512 PTEs
 #define PTE_W (1L << 2)
 #define PTE_X (1L << 3)
 #define PTE_U (1L << 4) // user can access
+#define PTE_D (1L << 7) // dirty: written since mapped
+#define PTE_COW (1L << 8) // software: copy-on-write, read-only until written
 
 // shift a physical address to the right place for a PTE.
 #define PA2PTE(pa) ((((uint64)pa) >> 12) << 10)
@@ -0,0 +1,64 @@
+// schedstat() queries; times are in time CSR cycles.
+#define SCHEDSTAT_CPU      0   // fill struct cpustat, one per online cpu
+#define SCHEDSTAT_KTHREAD  1   // fill struct kthreadstat, one per live kthread
+#define SCHEDSTAT_KMEM     2   // fill struct kmemstat, one per online cpu
+#define SCHEDSTAT_BUDDY    3   // fill one struct buddystat
+#define SCHEDSTAT_SLAB     4   // fill struct slabstat, one per object cache
+
+#define NLATHIST  32           // wakeup latency buckets: [2^i, 2^(i+1)) cycles
+
+struct cpustat {
+  int cpu;
+  int nrunnable;               // run queue length right now
+  uint64 nswtch;               // dispatches
+  uint64 nsteals;              // kthreads taken from other cpus' queues
+  uint64 nmigrations;          // dispatches of a kthread that last ran elsewhere
+  uint64 idletime;             // time with nothing to run
+  uint64 lathist[NLATHIST];    // wakeup-to-run latency, log2 histogram
+};
+
+struct kthreadstat {
+  int pid;
+  int tid;
+  int state;                   // enum threadstate
+  int cpu;                     // last cpu
+  char name[16];               // process name
+  uint64 runwait;              // time spent RUNNABLE waiting for a cpu
+  uint64 cputime;              // time spent RUNNING
+  uint64 nvcsw;                // voluntary switches: sleep()
+  uint64 nivcsw;               // involuntary switches: yield()
+};
+
+// page allocator counters; see kalloc.c.
+struct kmemstat {
+  int cpu;
+  int nfree;                   // pages on the cpu's free list
+  int npool;                   // pages in the shared pool
+  uint64 nalloc;               // pages allocated on the cpu
+  uint64 nkfree;               // pages freed on the cpu
+  uint64 nsteal;               // pages taken from other cpus' lists
+};
+
+// the page allocator's shared pool (needs param.h).
+struct buddystat {
+  int npool;                   // free pages in the pool
+  uint64 nblock[KMAXORDER+1];  // free blocks of 2^k pages
+  uint64 nsplit;               // blocks split in two to allocate
+  uint64 nmerge;               // blocks merged with their buddy on free
+  uint64 nfail;                // block allocations that failed with
+                               // enough free pages, none contiguous
+  int nzero;                   // pre-zeroed pages ready
+  uint64 nzerohit;             // kalloc_zeroed() calls that found one
+  uint64 nzeromiss;            // and that had to zero a page
+};
+
+// an object cache; see slab.c.
+struct slabstat {
+  char name[16];
+  uint size;                   // bytes per object
+  int perslab;                 // objects per page
+  int nslab;                   // pages in use
+  int ninuse;                  // objects allocated
+  uint64 nalloc;               // slaballoc() calls
+  uint64 nfree;                // slabfree() calls
+};
@@ -0,0 +1,191 @@
+// Shared-memory segments.
+//
+// A segment is a set of physical pages that any process can
+// attach, by the key it was created with, as an mmap() region
+// whose faults map the segment's pages instead of fresh ones
+// (see mmapfault()). Pages are allocated, zeroed, on first
+// touch by any participant. Each attaching region holds a
+// reference to the segment, including copies made by fork();
+// the segment goes away when the last of them is unmapped. A
+// segment no one has attached yet stays until someone has, or
+// until shmrm() removes it.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "fcntl.h"
+
+struct shm {
+  int used;
+  int key;                     // 0: private, never found by shmget()
+  int npages;
+  int nref;                    // regions attached
+  int removed;                 // by shmrm(): no new attaches
+  uint64 *pages;               // a page of page addresses, 0 if untouched
+};
+
+static struct spinlock shmlock;  // protects shms[]
+static struct shm shms[NSHM];
+
+void
+shminit(void)
+{
+  initlock(&shmlock, "shm");
+}
+
+// Free s's pages once no region refers to it.
+// Caller holds shmlock.
+static void
+shmfree(struct shm *s)
+{
+  for(int i = 0; i < s->npages; i++)
+    if(s->pages[i])
+      kfree((void*)s->pages[i]);
+  kfree(s->pages);
+  s->used = 0;
+}
+
+// Return the id of the segment with key, creating one of
+// size bytes if there is none, or -1. A key of 0 always
+// creates a new segment.
+int
+shmget(int key, uint64 size)
+{
+  struct shm *s, *free = 0;
+  uint64 npages = PGROUNDUP(size) / PGSIZE;
+
+  if(npages == 0 || npages > SHMMAXPAGES)
+    return -1;
+
+  acquire(&shmlock);
+  for(s = shms; s < &shms[NSHM]; s++){
+    if(s->used && key != 0 && s->key == key){
+      release(&shmlock);
+      return npages <= s->npages ? s - shms : -1;
+    }
+    if(!s->used && free == 0)
+      free = s;
+  }
+  if(free == 0 || (free->pages = kalloc_zeroed()) == 0){
+    release(&shmlock);
+    return -1;
+  }
+  free->used = 1;
+  free->key = key;
+  free->npages = npages;
+  free->nref = 0;
+  free->removed = 0;
+  release(&shmlock);
+  return free - shms;
+}
+
+// Attach segment id to the current process.
+// Returns its address, or -1.
+uint64
+shmat(int id)
+{
+  struct shm *s;
+  uint64 addr;
+
+  if(id < 0 || id >= NSHM)
+    return -1;
+  s = &shms[id];
+  acquire(&shmlock);
+  if(!s->used || s->removed){
+    release(&shmlock);
+    return -1;
+  }
+  s->nref++;     // for the region, or until mmap() fails
+  release(&shmlock);
+
+  addr = mmap((uint64)s->npages * PGSIZE, PROT_READ|PROT_WRITE,
+              MAP_SHARED, 0, 0, s);
+  if(addr == -1)
+    shmput(s);
+  return addr;
+}
+
+// Detach the segment attached at addr from the current
+// process. Returns 0, or -1 if none is attached there.
+int
+shmdt(uint64 addr)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 len = 0;
+
+  acquire(&p->vmlock);
+  for(v = p->vmas; v < &p->vmas[NVMA]; v++)
+    if(v->used && v->shm && v->addr == addr)
+      len = v->len;
+  release(&p->vmlock);
+  if(len == 0)
+    return -1;
+  return munmap(addr, len);
+}
+
+// Remove segment id: shmget() and shmat() no longer find it,
+// and it goes away once no region is attached, at once if
+// none is. Returns 0, or -1 if there is no such segment.
+int
+shmrm(int id)
+{
+  struct shm *s;
+
+  if(id < 0 || id >= NSHM)
+    return -1;
+  s = &shms[id];
+  acquire(&shmlock);
+  if(!s->used || s->removed){
+    release(&shmlock);
+    return -1;
+  }
+  s->removed = 1;
+  s->key = 0;
+  if(s->nref == 0)
+    shmfree(s);
+  release(&shmlock);
+  return 0;
+}
+
+// Another region refers to s.
+void
+shmdup(struct shm *s)
+{
+  acquire(&shmlock);
+  s->nref++;
+  release(&shmlock);
+}
+
+// A region referring to s is gone.
+void
+shmput(struct shm *s)
+{
+  acquire(&shmlock);
+  if(--s->nref == 0)
+    shmfree(s);
+  release(&shmlock);
+}
+
+// The physical address of page i of s, allocated if need be,
+// with a reference for the caller to map. Returns 0 if i is
+// out of range or memory ran out.
+uint64
+shmpage(struct shm *s, uint64 i)
+{
+  uint64 pa = 0;
+
+  acquire(&shmlock);
+  if(i < s->npages){
+    if(s->pages[i] == 0)
+      s->pages[i] = (uint64)kalloc_zeroed();
+    if((pa = s->pages[i]) != 0)
+      kref((void*)pa);
+  }
+  release(&shmlock);
+  return pa;
+}
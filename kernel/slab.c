@@ -0,0 +1,221 @@
+// Slab allocator: caches of same-sized kernel objects,
+// carved out of pages from kalloc().
+//
+// Each slab is one page: a struct slab header, then the
+// objects, so an object finds its slab by rounding down to
+// the page. Free objects in a slab are chained through their
+// first word. On top of the slabs each cpu keeps a magazine
+// of free objects, so that most slaballoc() and slabfree()
+// calls take no lock; a cpu refills an empty magazine, or
+// spills half of a full one, under the cache's lock.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "slab.h"
+#include "schedstat.h"
+#include "defs.h"
+
+struct slab {
+  struct slab *next;           // on cache->partial
+  struct slab *prev;
+  struct slabcache *cache;
+  void *freelist;
+  int nfree;
+};
+
+#define SLABHDR ((sizeof(struct slab) + 15) & ~15)
+
+static struct spinlock slablock; // protects caches
+static struct slabcache *caches;
+
+// Set up cache sc for objects of size bytes.
+void
+slabinit(struct slabcache *sc, char *name, uint size)
+{
+  static int first = 1;
+
+  if(first){
+    initlock(&slablock, "slabs");
+    first = 0;
+  }
+  memset(sc, 0, sizeof(*sc));
+  initlock(&sc->lock, name);
+  sc->name = name;
+  sc->size = (size + 15) & ~15;
+  sc->perslab = (PGSIZE - SLABHDR) / sc->size;
+  if(sc->perslab == 0)
+    panic("slabinit: size");
+
+  acquire(&slablock);
+  sc->next = caches;
+  caches = sc;
+  release(&slablock);
+}
+
+static void
+partiallink(struct slabcache *sc, struct slab *s)
+{
+  s->prev = 0;
+  s->next = sc->partial;
+  if(s->next)
+    s->next->prev = s;
+  sc->partial = s;
+}
+
+static void
+partialunlink(struct slabcache *sc, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    sc->partial = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+}
+
+// Add a new slab to sc. Caller holds sc->lock.
+static struct slab *
+newslab(struct slabcache *sc)
+{
+  struct slab *s;
+  char *obj;
+
+  if((s = (struct slab *)kalloc()) == 0)
+    return 0;
+  s->cache = sc;
+  s->freelist = 0;
+  for(int i = sc->perslab - 1; i >= 0; i--){
+    obj = (char *)s + SLABHDR + i * sc->size;
+    *(void **)obj = s->freelist;
+    s->freelist = obj;
+  }
+  s->nfree = sc->perslab;
+  partiallink(sc, s);
+  sc->nslab++;
+  sc->nslabfree += sc->perslab;
+  return s;
+}
+
+// Fill half of magazine m from the slabs.
+static void
+refill(struct slabcache *sc, struct slabmag *m)
+{
+  struct slab *s;
+  void *obj;
+
+  acquire(&sc->lock);
+  while(m->n < SLABMAG / 2){
+    if((s = sc->partial) == 0 && (s = newslab(sc)) == 0)
+      break;
+    obj = s->freelist;
+    s->freelist = *(void **)obj;
+    if(--s->nfree == 0)
+      partialunlink(sc, s);
+    sc->nslabfree--;
+    m->objs[m->n++] = obj;
+  }
+  release(&sc->lock);
+}
+
+// Return the older half of magazine m to the slabs, and
+// give back slabs that become free, keeping one spare.
+static void
+spill(struct slabcache *sc, struct slabmag *m)
+{
+  struct slab *s;
+  void *obj;
+  int i;
+
+  acquire(&sc->lock);
+  for(i = 0; i < SLABMAG / 2; i++){
+    obj = m->objs[i];
+    s = (struct slab *)PGROUNDDOWN((uint64)obj);
+    if(s->cache != sc)
+      panic("slabfree");
+    *(void **)obj = s->freelist;
+    s->freelist = obj;
+    if(s->nfree++ == 0)
+      partiallink(sc, s);
+    sc->nslabfree++;
+    if(s->nfree == sc->perslab && sc->nslabfree > sc->perslab){
+      partialunlink(sc, s);
+      sc->nslab--;
+      sc->nslabfree -= sc->perslab;
+      kfree(s);
+    }
+  }
+  memmove(m->objs, m->objs + i, (m->n - i) * sizeof(m->objs[0]));
+  m->n -= i;
+  release(&sc->lock);
+}
+
+// Allocate an object from sc, with undefined contents.
+// Returns 0 if out of memory.
+void *
+slaballoc(struct slabcache *sc)
+{
+  struct slabmag *m;
+  void *obj = 0;
+
+  push_off();
+  m = &sc->mag[cpuid()];
+  if(m->n == 0)
+    refill(sc, m);
+  if(m->n > 0){
+    obj = m->objs[--m->n];
+    m->nalloc++;
+  }
+  pop_off();
+  return obj;
+}
+
+// Free obj, which slaballoc(sc) returned.
+void
+slabfree(struct slabcache *sc, void *obj)
+{
+  struct slabmag *m;
+
+  push_off();
+  m = &sc->mag[cpuid()];
+  if(m->n == SLABMAG)
+    spill(sc, m);
+  m->objs[m->n++] = obj;
+  m->nfree++;
+  pop_off();
+}
+
+// Fill in *st for the i'th cache. Returns 0, or -1 if
+// there are not that many caches.
+int
+slabstat(int i, struct slabstat *st)
+{
+  struct slabcache *sc;
+  int nmag = 0;
+
+  acquire(&slablock);
+  for(sc = caches; sc && i > 0; sc = sc->next)
+    i--;
+  release(&slablock);
+  if(sc == 0)
+    return -1;
+
+  // racy snapshot of the magazines, like the scheduler
+  // counters.
+  memset(st, 0, sizeof(*st));
+  safestrcpy(st->name, sc->name, sizeof(st->name));
+  st->size = sc->size;
+  st->perslab = sc->perslab;
+  for(struct slabmag *m = sc->mag; m < &sc->mag[NCPU]; m++){
+    nmag += m->n;
+    st->nalloc += m->nalloc;
+    st->nfree += m->nfree;
+  }
+  acquire(&sc->lock);
+  st->nslab = sc->nslab;
+  st->ninuse = sc->nslab * sc->perslab - sc->nslabfree - nmag;
+  release(&sc->lock);
+  return 0;
+}
@@ -0,0 +1,24 @@
+// Object caches; see slab.c.
+
+#define SLABMAG 16             // objects in a cpu's magazine
+
+// Objects a cpu can allocate and free without taking the
+// cache's lock. Touched only by its cpu, with interrupts off.
+struct slabmag {
+  int n;
+  void *objs[SLABMAG];
+  uint64 nalloc;               // slaballoc() calls served
+  uint64 nfree;                // slabfree() calls
+};
+
+struct slabcache {
+  struct spinlock lock;        // protects the slab fields below
+  char *name;
+  uint size;                   // object size, rounded up
+  int perslab;                 // objects in each page
+  struct slab *partial;        // slabs with free objects
+  int nslab;                   // pages in use
+  int nslabfree;               // free objects in slabs, not magazines
+  struct slabcache *next;      // all caches, for slabstat()
+  struct slabmag mag[NCPU];
+};
@@ -27,6 +27,7 @@ acquiresleep(struct sleeplock *lk)
   }
   lk->locked = 1;
   lk->pid = myproc()->pid;
+  mykthread()->nsleeplock++;
   release(&lk->lk);
 }
 
@@ -36,7 +37,8 @@ releasesleep(struct sleeplock *lk)
   acquire(&lk->lk);
   lk->locked = 0;
   lk->pid = 0;
-  wakeup(lk);
+  mykthread()->nsleeplock--;
+  wakeup_one(lk);
   release(&lk->lk);
 }
 
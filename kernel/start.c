@@ -11,7 +11,7 @@ void timerinit();
 __attribute__ ((aligned (16))) char stack0[4096 * NCPU];
 
 // a scratch area per CPU for machine-mode timer interrupts.
-uint64 timer_scratch[NCPU][5];
+uint64 timer_scratch[NCPU][NSCRATCH];
 
 // assembly code in kernelvec.S for machine-mode timer interrupt.
 extern void timervec();
@@ -38,6 +38,11 @@ start()
   w_mideleg(0xffff);
   w_sie(r_sie() | SIE_SEIE | SIE_STIE | SIE_SSIE);
 
+  // allow supervisor mode to read the time CSR, for r_time(),
+  // and user mode too, for the clock in the vdso time page.
+  w_mcounteren(r_mcounteren() | 2);
+  w_scounteren(r_scounteren() | 2);
+
   // configure Physical Memory Protection to give supervisor mode
   // access to all of physical memory.
   w_pmpaddr0(0x3fffffffffffffull);
@@ -66,16 +71,28 @@ timerinit()
   int id = r_mhartid();
 
   // ask the CLINT for a timer interrupt.
-  int interval = 1000000; // cycles; about 1/10th second in qemu.
+  int interval = TICKCYCLES; // cycles; about 1/10th second in qemu.
   *(uint64*)CLINT_MTIMECMP(id) = *(uint64*)CLINT_MTIME + interval;
 
   // prepare information in scratch[] for timervec.
   // scratch[0..2] : space for timervec to save registers.
   // scratch[3] : address of CLINT MTIMECMP register.
   // scratch[4] : desired interval (in cycles) between timer interrupts.
+  // scratch[5] : timer interrupts so far, so devintr() can tell
+  //              them from wake-up IPIs.
+  // scratch[6] : address of CLINT MSIP register.
+  // scratch[7] : time of the next tick.
+  // scratch[8] : time of the next hrtimer deadline, set by
+  //              hrtimerarm(), or ~0.
+  // scratch[9] : address of CLINT MTIME register.
   uint64 *scratch = &timer_scratch[id][0];
   scratch[3] = CLINT_MTIMECMP(id);
   scratch[4] = interval;
+  scratch[5] = 0;
+  scratch[6] = CLINT_MSIP(id);
+  scratch[7] = *(uint64*)CLINT_MTIMECMP(id);
+  scratch[8] = ~0ULL;
+  scratch[9] = CLINT_MTIME;
   w_mscratch((uint64)scratch);
 
   // set the machine-mode trap handler.
@@ -84,6 +101,7 @@ timerinit()
   // enable machine-mode interrupts.
   w_mstatus(r_mstatus() | MSTATUS_MIE);
 
-  // enable machine-mode timer interrupts.
-  w_mie(r_mie() | MIE_MTIE);
+  // enable machine-mode timer and software interrupts;
+  // the latter are IPIs that wake an idle cpu.
+  w_mie(r_mie() | MIE_MTIE | MIE_MSIE);
 }
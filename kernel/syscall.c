@@ -6,6 +6,7 @@
 #include "proc.h"
 #include "syscall.h"
 #include "defs.h"
+#include "vdso.h"
 
 // Fetch the uint64 at addr from the current process.
 int fetchaddr(uint64 addr, uint64 *ip)
@@ -87,6 +88,18 @@ extern uint64 sys_kthread_exit(void);
 extern uint64 sys_kthread_id(void);
 extern uint64 sys_kthread_join(void);
 extern uint64 sys_kthread_kill(void);
+extern uint64 sys_futex(void);
+extern uint64 sys_kthread_setaffinity(void);
+extern uint64 sys_kthread_getaffinity(void);
+extern uint64 sys_nice(void);
+extern uint64 sys_schedstat(void);
+extern uint64 sys_nanosleep(void);
+extern uint64 sys_mmap(void);
+extern uint64 sys_munmap(void);
+extern uint64 sys_shmget(void);
+extern uint64 sys_shmat(void);
+extern uint64 sys_shmdt(void);
+extern uint64 sys_shmrm(void);
 extern uint64 sys_exec(void);
 extern uint64 sys_fstat(void);
 extern uint64 sys_chdir(void);
@@ -117,6 +130,18 @@ static uint64 (*syscalls[])(void) = {
     [SYS_kthread_id] sys_kthread_id,
     [SYS_kthread_join] sys_kthread_join,
     [SYS_kthread_kill] sys_kthread_kill,
+    [SYS_futex] sys_futex,
+    [SYS_kthread_setaffinity] sys_kthread_setaffinity,
+    [SYS_kthread_getaffinity] sys_kthread_getaffinity,
+    [SYS_nice] sys_nice,
+    [SYS_schedstat] sys_schedstat,
+    [SYS_nanosleep] sys_nanosleep,
+    [SYS_mmap] sys_mmap,
+    [SYS_munmap] sys_munmap,
+    [SYS_shmget] sys_shmget,
+    [SYS_shmat] sys_shmat,
+    [SYS_shmdt] sys_shmdt,
+    [SYS_shmrm] sys_shmrm,
     [SYS_exec] sys_exec,
     [SYS_fstat] sys_fstat,
     [SYS_chdir] sys_chdir,
@@ -141,6 +166,7 @@ void syscall(void)
   struct kthread *kt = mykthread();
 
   num = kt->trapframe->a7;
+  __sync_fetch_and_add(&p->vproc->nsyscall, 1);
   if (num > 0 && num < NELEM(syscalls) && syscalls[num])
   {
     // Use num to lookup the system call function for num, call it,
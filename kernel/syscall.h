@@ -25,3 +25,15 @@
 #define SYS_kthread_id 24
 #define SYS_kthread_join 25
 #define SYS_kthread_kill 26
+#define SYS_futex 27
+#define SYS_kthread_setaffinity 28
+#define SYS_kthread_getaffinity 29
+#define SYS_nice 30
+#define SYS_schedstat 31
+#define SYS_nanosleep 32
+#define SYS_mmap 33
+#define SYS_munmap 34
+#define SYS_shmget 35
+#define SYS_shmat 36
+#define SYS_shmdt 37
+#define SYS_shmrm 38
@@ -76,6 +76,7 @@ sys_read(void)
   argint(2, &n);
   if(argfd(0, 0, &f) < 0)
     return -1;
+  vmprefault(p, n, 1);
   return fileread(f, p, n);
 }
 
@@ -90,6 +91,7 @@ sys_write(void)
   argint(2, &n);
   if(argfd(0, 0, &f) < 0)
     return -1;
+  vmprefault(p, n, 0);
 
   return filewrite(f, p, n);
 }
@@ -503,3 +505,39 @@ sys_pipe(void)
   }
   return 0;
 }
+
+uint64
+sys_mmap(void)
+{
+  uint64 addr, len;
+  int prot, flags, off, share;
+  struct file *f = 0;
+
+  argaddr(0, &addr);   // a hint, which is ignored
+  argaddr(1, &len);
+  argint(2, &prot);
+  argint(3, &flags);
+  argint(5, &off);
+  share = flags & (MAP_SHARED|MAP_PRIVATE);
+  if(share != MAP_SHARED && share != MAP_PRIVATE)
+    return -1;
+  if(off < 0 || off % PGSIZE != 0)
+    return -1;
+  if((flags & MAP_ANONYMOUS) == 0){
+    if(argfd(4, 0, &f) < 0 || f->type != FD_INODE || !f->readable)
+      return -1;
+    if(share == MAP_SHARED && (prot & PROT_WRITE) && !f->writable)
+      return -1;
+  }
+  return mmap(len, prot, flags, f, off, 0);
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr, len;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  return munmap(addr, len);
+}
@@ -5,6 +5,7 @@
 #include "memlayout.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "futex.h"
 
 uint64
 sys_exit(void)
@@ -32,6 +33,8 @@ sys_wait(void)
 {
   uint64 p;
   argaddr(0, &p);
+  // wait() copies out the status with locks held.
+  vmprefault(p, sizeof(int), 1);
   return wait(p);
 }
 
@@ -52,22 +55,11 @@ uint64
 sys_sleep(void)
 {
   int n;
-  uint ticks0;
 
   argint(0, &n);
-  acquire(&tickslock);
-  ticks0 = ticks;
-  while (ticks - ticks0 < n)
-  {
-    if (killed(myproc()) || kthread_killed(mykthread()))
-    {
-      release(&tickslock);
-      return -1;
-    }
-    sleep(&ticks, &tickslock);
-  }
-  release(&tickslock);
-  return 0;
+  if (n <= 0)
+    return 0;
+  return hrtimersleep(r_time() + (uint64)n * TICKCYCLES);
 }
 
 uint64
@@ -81,14 +73,15 @@ sys_kill(void)
 
 uint64 sys_kthread_create(void)
 {
-  uint64 fn, stack;
+  uint64 fn, stack, tls;
   uint stack_size;
 
   argaddr(0, &fn);
   argaddr(1, &stack);
   argint(2, (int *)&stack_size);
+  argaddr(3, &tls);
 
-  return kthread_create((void *(*)(void *))fn, (void *)stack, stack_size);
+  return kthread_create((void *(*)(void *))fn, (void *)stack, stack_size, (void *)tls);
   }
 
 uint64 sys_kthread_id(void)
@@ -119,10 +112,111 @@ uint64 sys_kthread_join(void)
 
   argint(0, &ktid);
   argaddr(1, &status);
+  // as for wait().
+  vmprefault(status, sizeof(int), 1);
 
   return kthread_join(ktid, status);
 }
 
+uint64 sys_kthread_setaffinity(void)
+{
+  int ktid, mask;
+
+  argint(0, &ktid);
+  argint(1, &mask);
+  return kthread_setaffinity(ktid, mask);
+}
+
+uint64 sys_kthread_getaffinity(void)
+{
+  int ktid;
+
+  argint(0, &ktid);
+  return kthread_getaffinity(ktid);
+}
+
+uint64 sys_nice(void)
+{
+  int inc;
+
+  argint(0, &inc);
+  return nice(inc);
+}
+
+uint64 sys_nanosleep(void)
+{
+  uint64 ns;
+
+  argaddr(0, &ns);
+  if (ns == 0)
+    return 0;
+  return hrtimersleep(r_time() + ns / (1000000000 / TIMEBASE));
+}
+
+uint64 sys_schedstat(void)
+{
+  int what, n;
+  uint64 addr;
+
+  argint(0, &what);
+  argaddr(1, &addr);
+  argint(2, &n);
+  return schedstat(what, addr, n);
+}
+
+uint64 sys_futex(void)
+{
+  uint64 addr;
+  int op, val;
+
+  argaddr(0, &addr);
+  argint(1, &op);
+  argint(2, &val);
+
+  switch (op)
+  {
+  case FUTEX_WAIT:
+    return futex_wait(addr, val);
+  case FUTEX_WAKE:
+    return futex_wake(addr, val);
+  }
+  return -1;
+}
+
+uint64 sys_shmget(void)
+{
+  int key;
+  uint64 size;
+
+  argint(0, &key);
+  argaddr(1, &size);
+  return shmget(key, size);
+}
+
+uint64 sys_shmat(void)
+{
+  int id;
+
+  argint(0, &id);
+  return shmat(id);
+}
+
+uint64 sys_shmdt(void)
+{
+  uint64 addr;
+
+  argaddr(0, &addr);
+  return shmdt(addr);
+}
+
+uint64 sys_shmrm(void)
+{
+  int id;
+
+  argint(0, &id);
+  return shmrm(id);
+}
+
 // return how many clock tick interrupts have occurred
 // since start.
 uint64
@@ -5,6 +5,7 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "fcntl.h"
 
 struct spinlock tickslock;
 uint ticks;
@@ -14,6 +15,9 @@ extern char trampoline[], uservec[], userret[];
 // in kernelvec.S, calls kerneltrap().
 void kernelvec();
 
+// in start.c, shared with timervec.
+extern uint64 timer_scratch[NCPU][NSCRATCH];
+
 extern int devintr();
 
 void trapinit(void)
@@ -44,6 +48,8 @@ void usertrap(void)
 
   struct proc *p = myproc();
   struct kthread *kt = mykthread();
+  mycpu()->inuser = 0;
+  mycpu()->nutrap++;
   // save user program counter.
   kt->trapframe->epc = r_sepc();
 
@@ -67,6 +73,23 @@ void usertrap(void)
 
     syscall();
   }
+  else if (r_scause() == 12 || r_scause() == 13 || r_scause() == 15)
+  {
+    // first touch of a program, heap or mmap() page, or
+    // store to a copy-on-write page. reading the page in
+    // may sleep, so enable interrupts, as for a system
+    // call, once done with the registers.
+    uint64 scause = r_scause(), stval = r_stval();
+    intr_on();
+    if (vmfault(p, stval, scause == 12 ? PROT_EXEC :
+                          scause == 13 ? PROT_READ : PROT_WRITE) < 0)
+    {
+      printf("usertrap(): unexpected scause %p pid=%d\n", scause, p->pid);
+      printf("            sepc=%p stval=%p\n", kt->trapframe->epc, stval);
+      setkilled(p);
+      setkthreadkilled(kt);
+    }
+  }
   else if ((which_dev = devintr()) != 0)
   {
     // ok
@@ -85,8 +108,9 @@ void usertrap(void)
   if (kthread_killed(kt))
     kthread_exit(-1);
 
-  // give up the CPU if this is a timer interrupt.
-  if (which_dev == 2)
+  // give up the CPU if this timer interrupt ends its
+  // quantum or a higher-priority kthread is waiting.
+  if (which_dev == 2 && schedtick())
     yield();
 
   usertrapret();
@@ -135,7 +159,8 @@ void usertrapret(void)
   // switches to the user page table, restores user registers,
   // and switches to user mode with sret.
   uint64 trampoline_userret = TRAMPOLINE + (userret - trampoline);
-  ((void (*)(uint64, uint64))trampoline_userret)(TRAPFRAME((uint)(kt - p->kthread)), satp);
+  mycpu()->inuser = 1;
+  ((void (*)(uint64, uint64))trampoline_userret)(TRAPFRAME(kt->slot), satp);
 }
 
 // interrupts and exceptions from kernel code go here via kernelvec,
@@ -160,8 +185,10 @@ void kerneltrap()
     panic("kerneltrap");
   }
 
-  // give up the CPU if this is a timer interrupt.
-  if (which_dev == 2 && mykthread() != 0 && mykthread()->tstate == RUNNING)
+  // give up the CPU if this timer interrupt ends its
+  // quantum or a higher-priority kthread is waiting.
+  if (which_dev == 2 && mykthread() != 0 && mykthread()->tstate == RUNNING &&
+      schedtick())
     yield();
 
   // the yield() may have caused some traps to occur,
@@ -174,7 +201,7 @@ void clockintr()
 {
   acquire(&tickslock);
   ticks++;
-  wakeup(&ticks);
+  vdsotick(ticks);
   release(&tickslock);
 }
 
@@ -218,18 +245,30 @@ int devintr()
   }
   else if (scause == 0x8000000000000001L)
   {
-    // software interrupt from a machine-mode timer interrupt,
-    // forwarded by timervec in kernelvec.S.
+    // software interrupt from a machine-mode timer interrupt
+    // or wake-up IPI, forwarded by timervec in kernelvec.S.
+    struct cpu *c = mycpu();
+    uint64 n;
+
+    // acknowledge the software interrupt by clearing
+    // the SSIP bit in sip. a timer interrupt after this
+    // sets it again, so none is lost.
+    w_sip(r_sip() & ~2);
+
+    hrtimerintr();
+
+    // only an IPI or deadline if timervec's tick count has
+    // not moved; no tick to account for.
+    n = timer_scratch[cpuid()][5];
+    if (n == c->timerticks)
+      return 1;
+    c->timerticks = n;
 
     if (cpuid() == 0)
     {
       clockintr();
     }
 
-    // acknowledge the software interrupt by clearing
-    // the SSIP bit in sip.
-    w_sip(r_sip() & ~2);
-
     return 2;
   }
   else
@@ -0,0 +1,34 @@
+// The time page shared read-only with every process;
+// see vdso.h.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "defs.h"
+#include "vdso.h"
+
+struct vdsotime *vdsotime;
+
+void
+vdsoinit(void)
+{
+  if ((vdsotime = (struct vdsotime *)kalloc()) == 0)
+    panic("vdsoinit");
+  memset(vdsotime, 0, PGSIZE);
+  vdsotime->timebase = TIMEBASE;
+  vdsotime->tickcycles = TICKCYCLES;
+}
+
+// Publish a new tick count. Called by clockintr()
+// with tickslock held, so there is one writer.
+void
+vdsotick(uint ticks)
+{
+  vdsotime->seq++;
+  __sync_synchronize();
+  vdsotime->ticks = ticks;
+  vdsotime->ticktime = r_time();
+  __sync_synchronize();
+  vdsotime->seq++;
+}
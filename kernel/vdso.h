@@ -0,0 +1,24 @@
+// Pages the kernel maps read-only into every process, so
+// user code can read the clock and its own counters without
+// a system call. They sit just below the trapframe pages
+// (see memlayout.h).
+#define VDSOTIME  0x3fffff0000L  // struct vdsotime, shared by all
+#define VDSOPROC  0x3ffffef000L  // struct vdsoproc, one per process
+
+// Updated by clockintr() under a sequence lock: seq is odd
+// while an update is in progress, so a reader retries if it
+// sees an odd seq, or seq changes while it reads.
+struct vdsotime {
+  uint seq;
+  uint ticks;                  // as returned by uptime()
+  uint64 ticktime;             // time CSR at the last tick
+  uint64 timebase;             // time CSR ticks per second
+  uint64 tickcycles;           // time CSR ticks per clock tick
+};
+
+// Each field is a single word updated atomically on its own.
+struct vdsoproc {
+  int pid;
+  uint64 nsyscall;             // system calls made by the process
+  uint64 cputime;              // time CSR ticks its kthreads ran
+};
@@ -0,0 +1,107 @@
+#include "kernel/types.h"
+#include "kernel/futex.h"
+#include "user/user.h"
+#include "user/ksync.h"
+
+#define WAKE_ALL 0x7fffffff
+
+void
+kmutex_init(struct kmutex *m)
+{
+  m->state = 0;
+}
+
+void
+kmutex_lock(struct kmutex *m)
+{
+  int c;
+
+  // fast path: 0 -> 1 without entering the kernel.
+  if((c = __sync_val_compare_and_swap(&m->state, 0, 1)) == 0)
+    return;
+
+  // mark the mutex contended, and sleep until the
+  // holder unlocks it.
+  if(c != 2)
+    c = __sync_lock_test_and_set(&m->state, 2);
+  while(c != 0){
+    futex(&m->state, FUTEX_WAIT, 2);
+    c = __sync_lock_test_and_set(&m->state, 2);
+  }
+}
+
+void
+kmutex_unlock(struct kmutex *m)
+{
+  // only enter the kernel if someone may be waiting.
+  if(__sync_fetch_and_sub(&m->state, 1) != 1){
+    __sync_synchronize();
+    m->state = 0;
+    futex(&m->state, FUTEX_WAKE, 1);
+  }
+}
+
+void
+kcond_init(struct kcond *cv)
+{
+  cv->seq = 0;
+}
+
+// Atomically unlock m and wait for a signal on cv,
+// then relock m. May return spuriously, so callers
+// re-check their condition in a loop.
+void
+kcond_wait(struct kcond *cv, struct kmutex *m)
+{
+  int seq = cv->seq;
+
+  kmutex_unlock(m);
+  futex(&cv->seq, FUTEX_WAIT, seq);
+  kmutex_lock(m);
+}
+
+void
+kcond_signal(struct kcond *cv)
+{
+  __sync_fetch_and_add(&cv->seq, 1);
+  futex(&cv->seq, FUTEX_WAKE, 1);
+}
+
+void
+kcond_broadcast(struct kcond *cv)
+{
+  __sync_fetch_and_add(&cv->seq, 1);
+  futex(&cv->seq, FUTEX_WAKE, WAKE_ALL);
+}
+
+void
+kbarrier_init(struct kbarrier *b, int n)
+{
+  kmutex_init(&b->lock);
+  b->n = n;
+  b->count = 0;
+  b->phase = 0;
+}
+
+// Wait until n kthreads have called kbarrier_wait().
+// Returns 1 in the kthread that opened the barrier, 0 in the rest.
+int
+kbarrier_wait(struct kbarrier *b)
+{
+  int phase;
+
+  kmutex_lock(&b->lock);
+  phase = b->phase;
+  if(++b->count == b->n){
+    b->count = 0;
+    __sync_fetch_and_add(&b->phase, 1);
+    kmutex_unlock(&b->lock);
+    futex(&b->phase, FUTEX_WAKE, WAKE_ALL);
+    return 1;
+  }
+  kmutex_unlock(&b->lock);
+
+  while(*(volatile int*)&b->phase == phase)
+    futex(&b->phase, FUTEX_WAIT, phase);
+  return 0;
+}
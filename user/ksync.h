@@ -0,0 +1,30 @@
+// Blocking synchronization for kthreads, built on futex().
+// Uncontended operations stay in user space; waiters park
+// in the kernel instead of spinning.
+
+struct kmutex {
+  int state;    // 0 unlocked, 1 locked, 2 locked with waiters
+};
+
+struct kcond {
+  int seq;      // bumped by every signal/broadcast
+};
+
+struct kbarrier {
+  struct kmutex lock;
+  int n;        // number of kthreads to wait for
+  int count;    // number arrived in the current phase
+  int phase;    // bumped each time the barrier opens
+};
+
+void kmutex_init(struct kmutex*);
+void kmutex_lock(struct kmutex*);
+void kmutex_unlock(struct kmutex*);
+
+void kcond_init(struct kcond*);
+void kcond_wait(struct kcond*, struct kmutex*);
+void kcond_signal(struct kcond*);
+void kcond_broadcast(struct kcond*);
+
+void kbarrier_init(struct kbarrier*, int n);
+int kbarrier_wait(struct kbarrier*);
@@ -0,0 +1,75 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/param.h"
+#include "kernel/schedstat.h"
+#include "user/user.h"
+
+// print scheduler statistics: per-cpu counters and wakeup
+// latency histograms, then one line per live kthread, then
+// the page allocator's per-cpu counters and free blocks, and
+// the kernel's object caches.
+// times are in time CSR cycles (10MHz in qemu).
+
+static char *states[] = {
+  [0] "unused", [1] "used", [2] "sleep", [3] "runble", [4] "run", [5] "zombie"
+};
+
+#define NSLABSTAT 16
+
+struct cpustat cs[NCPU];
+struct kthreadstat ks[NTHREAD];
+struct kmemstat ms[NCPU];
+struct buddystat bs;
+struct slabstat ss[NSLABSTAT];
+
+int
+main(int argc, char *argv[])
+{
+  int ncpu, nkt, nkm, nss, i, b;
+
+  if((ncpu = schedstat(SCHEDSTAT_CPU, cs, NCPU)) < 0 ||
+     (nkt = schedstat(SCHEDSTAT_KTHREAD, ks, NTHREAD)) < 0 ||
+     (nkm = schedstat(SCHEDSTAT_KMEM, ms, NCPU)) < 0 ||
+     schedstat(SCHEDSTAT_BUDDY, &bs, 1) != 1 ||
+     (nss = schedstat(SCHEDSTAT_SLAB, ss, NSLABSTAT)) < 0){
+    fprintf(2, "schedstat: failed\n");
+    exit(1);
+  }
+
+  for(i = 0; i < ncpu; i++){
+    printf("cpu %d: runq %d switches %l steals %l migrations %l idle %l\n",
+           cs[i].cpu, cs[i].nrunnable, cs[i].nswtch, cs[i].nsteals,
+           cs[i].nmigrations, cs[i].idletime);
+    for(b = 0; b < NLATHIST; b++)
+      if(cs[i].lathist[b])
+        printf("  latency >= %l: %l\n", 1L << b, cs[i].lathist[b]);
+  }
+
+  printf("pid tid state cpu runwait cputime vol invol name\n");
+  for(i = 0; i < nkt; i++){
+    printf("%d %d %s %d %l %l %l %l %s\n",
+           ks[i].pid, ks[i].tid, states[ks[i].state], ks[i].cpu,
+           ks[i].runwait, ks[i].cputime, ks[i].nvcsw, ks[i].nivcsw,
+           ks[i].name);
+  }
+
+  for(i = 0; i < nkm; i++){
+    printf("kmem cpu %d: free %d pool %d allocs %l frees %l steals %l\n",
+           ms[i].cpu, ms[i].nfree, ms[i].npool, ms[i].nalloc,
+           ms[i].nkfree, ms[i].nsteal);
+  }
+  printf("kmem pool: free %d splits %l merges %l fragfails %l\n",
+         bs.npool, bs.nsplit, bs.nmerge, bs.nfail);
+  printf("kmem zeroed: ready %d hits %l misses %l\n",
+         bs.nzero, bs.nzerohit, bs.nzeromiss);
+  for(b = 0; b <= KMAXORDER; b++)
+    if(bs.nblock[b])
+      printf("  %d-page blocks: %l\n", 1 << b, bs.nblock[b]);
+
+  printf("cache size perslab pages inuse allocs frees\n");
+  for(i = 0; i < nss; i++){
+    printf("%s %d %d %d %d %l %l\n", ss[i].name, ss[i].size, ss[i].perslab,
+           ss[i].nslab, ss[i].ninuse, ss[i].nalloc, ss[i].nfree);
+  }
+  exit(0);
+}
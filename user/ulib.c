@@ -1,8 +1,20 @@
 #include "kernel/types.h"
 #include "kernel/stat.h"
 #include "kernel/fcntl.h"
+#include "kernel/vdso.h"
 #include "user/user.h"
 
+//
+// thread-local storage. user.ld lays out the .tdata/.tbss
+// template; a thread's TLS block is a copy of it, and tp
+// points at its start (RISC-V variant I, local-exec model).
+// Weak so that programs linked without user.ld still link.
+//
+extern char __tdata_start[] __attribute__((weak));
+extern char __tdata_end[] __attribute__((weak));
+extern char __tls_end[] __attribute__((weak));
+extern char __tls_main[] __attribute__((weak));
+
 //
 // wrapper so that it's OK if main() does not call exit().
 //
@@ -10,10 +22,72 @@ void
 _main()
 {
   extern int main();
+  if(__tls_main)
+    asm volatile("mv tp, %0" : : "r" (kthread_tls_init(__tls_main)));
   main();
   exit(0);
 }
 
+// bytes a caller must supply for one TLS block,
+// including slack for aligning it.
+uint
+kthread_tls_size(void)
+{
+  return (__tls_end - __tdata_start) + TLS_ALIGN;
+}
+
+// initialize a TLS block and return the value to pass to
+// kthread_create(). the initial thread's block is set up by _main.
+void*
+kthread_tls_init(void *block)
+{
+  char *tp;
+
+  tp = (char*)(((uint64)block + TLS_ALIGN - 1) & ~(uint64)(TLS_ALIGN - 1));
+  memmove(tp, __tdata_start, __tdata_end - __tdata_start);
+  memset(tp + (__tdata_end - __tdata_start), 0, __tls_end - __tdata_end);
+  return tp;
+}
+
+//
+// clock and counters read from the pages the kernel maps
+// into every process, without a system call.
+//
+
+// same as uptime().
+uint
+vdso_ticks(void)
+{
+  volatile struct vdsotime *vt = (struct vdsotime*)VDSOTIME;
+  uint seq, t;
+
+  do {
+    seq = vt->seq;
+    __sync_synchronize();
+    t = vt->ticks;
+    __sync_synchronize();
+  } while((seq & 1) || seq != vt->seq);
+  return t;
+}
+
+// nanoseconds since boot.
+uint64
+vdso_nsec(void)
+{
+  volatile struct vdsotime *vt = (struct vdsotime*)VDSOTIME;
+  uint64 t;
+
+  asm volatile("rdtime %0" : "=r" (t));
+  return t * (1000000000 / vt->timebase);
+}
+
+// this process's counters.
+const struct vdsoproc*
+vdso_proc(void)
+{
+  return (const struct vdsoproc*)VDSOPROC;
+}
+
 char*
 strcpy(char *s, const char *t)
 {
@@ -1,4 +1,5 @@
 struct stat;
+struct vdsoproc;
 
 // system calls
 int fork(void);
@@ -9,11 +10,23 @@ int write(int, const void*, int);
 int read(int, void*, int);
 int close(int);
 int kill(int);
-int kthread_create( void*(*)(), void*, uint);
+int kthread_create( void*(*)(), void*, uint, void*);
 int kthread_exit(int);
 int kthread_id(void);
 int kthread_join(int, int*);
 int kthread_kill(int);
+int futex(int*, int, int);
+int kthread_setaffinity(int, int);
+int kthread_getaffinity(int);
+int nice(int);
+int schedstat(int, void*, int);
+int nanosleep(uint64);
+void *mmap(void*, uint64, int, int, int, int);
+int munmap(void*, uint64);
+int shmget(int, uint64);
+void *shmat(int);
+int shmdt(void*);
+int shmrm(int);
 int exec(const char*, char**);
 int open(const char*, int);
 int mknod(const char*, short, short);
@@ -44,3 +57,10 @@ void free(void*);
 int atoi(const char*);
 int memcmp(const void *, const void *, uint);
 void *memcpy(void *, const void *, uint);
+uint vdso_ticks(void);
+uint64 vdso_nsec(void);
+const struct vdsoproc* vdso_proc(void);
+uint kthread_tls_size(void);
+void* kthread_tls_init(void*);
+
+#define TLS_ALIGN 16
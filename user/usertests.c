@@ -5,9 +5,13 @@
 #include "kernel/fs.h"
 #include "kernel/fcntl.h"
 #include "kernel/syscall.h"
+#include "kernel/futex.h"
+#include "kernel/schedstat.h"
+#include "kernel/vdso.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
 #include "user/uthread.h"
+#include "user/ksync.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -3018,14 +3022,14 @@ void klttest()
   uint64 stack_a = (uint64)malloc(MAX_STACK_SIZE);
   uint64 stack_b = (uint64)malloc(MAX_STACK_SIZE);
 
-  int kt_a = kthread_create((void *(*)())kthread_start_func, (void *)stack_a, MAX_STACK_SIZE);
+  int kt_a = kthread_create((void *(*)())kthread_start_func, (void *)stack_a, MAX_STACK_SIZE, 0);
   if (kt_a <= 0)
   {
     printf("kthread_create failed\n");
     exit(1);
   }
 
-  int kt_b = kthread_create((void *(*)())kthread_start_func, (void *)stack_b, MAX_STACK_SIZE);
+  int kt_b = kthread_create((void *(*)())kthread_start_func, (void *)stack_b, MAX_STACK_SIZE, 0);
   if (kt_a <= 0)
   {
     printf("kthread_create failed\n");
@@ -3050,6 +3054,893 @@ void klttest()
   free((void *)stack_b);
 }
 
+#define FUTEX_NTHREADS 4
+#define FUTEX_ITERS 1000
+struct kmutex futex_mutex;
+struct kbarrier futex_barrier;
+int futex_counter;
+
+void futex_start_func(void)
+{
+  for (int i = 0; i < FUTEX_ITERS; i++)
+  {
+    kmutex_lock(&futex_mutex);
+    int c = futex_counter;
+    if (i % 100 == 0)
+      nanosleep(1000); // block, so others run inside the critical section
+    futex_counter = c + 1;
+    kmutex_unlock(&futex_mutex);
+  }
+  kbarrier_wait(&futex_barrier);
+  kthread_exit(0);
+}
+
+// kthreads contend on a futex-based mutex and meet at a barrier.
+void futextest(char *s)
+{
+  int tids[FUTEX_NTHREADS];
+  void *stacks[FUTEX_NTHREADS];
+  int word = 1;
+
+  // FUTEX_WAIT must not sleep if the value already changed.
+  if (futex(&word, FUTEX_WAIT, 0) != -1)
+  {
+    printf("%s: futex wait on stale value did not return\n", s);
+    exit(1);
+  }
+
+  kmutex_init(&futex_mutex);
+  kbarrier_init(&futex_barrier, FUTEX_NTHREADS);
+  futex_counter = 0;
+
+  for (int i = 0; i < FUTEX_NTHREADS; i++)
+  {
+    stacks[i] = malloc(MAX_STACK_SIZE);
+    tids[i] = kthread_create((void *(*)())futex_start_func, stacks[i], MAX_STACK_SIZE, 0);
+    if (tids[i] <= 0)
+    {
+      printf("%s: kthread_create failed\n", s);
+      exit(1);
+    }
+  }
+  for (int i = 0; i < FUTEX_NTHREADS; i++)
+  {
+    if (kthread_join(tids[i], 0) != 0)
+    {
+      printf("%s: kthread_join failed\n", s);
+      exit(1);
+    }
+    free(stacks[i]);
+  }
+
+  if (futex_counter != FUTEX_NTHREADS * FUTEX_ITERS)
+  {
+    printf("%s: counter %d, expected %d\n", s, futex_counter, FUTEX_NTHREADS * FUTEX_ITERS);
+    exit(1);
+  }
+}
+
+#define WIDE_NTHREADS (NKT - 1)
+int wide_started;
+
+void wide_start_func(void)
+{
+  __sync_fetch_and_add(&wide_started, 1);
+  kthread_exit(7);
+}
+
+// more kthreads than the old fixed per-process table allowed.
+void widethreads(char *s)
+{
+  int tids[WIDE_NTHREADS];
+  void *stacks[WIDE_NTHREADS];
+  int status;
+
+  wide_started = 0;
+  for (int i = 0; i < WIDE_NTHREADS; i++)
+  {
+    stacks[i] = malloc(MAX_STACK_SIZE);
+    tids[i] = kthread_create((void *(*)())wide_start_func, stacks[i], MAX_STACK_SIZE, 0);
+    if (tids[i] <= 0)
+    {
+      printf("%s: kthread_create %d failed\n", s, i);
+      exit(1);
+    }
+  }
+  for (int i = 0; i < WIDE_NTHREADS; i++)
+  {
+    if (kthread_join(tids[i], &status) != 0 || status != 7)
+    {
+      printf("%s: kthread_join %d failed\n", s, i);
+      exit(1);
+    }
+    free(stacks[i]);
+  }
+  if (wide_started != WIDE_NTHREADS)
+  {
+    printf("%s: only %d of %d kthreads ran\n", s, wide_started, WIDE_NTHREADS);
+    exit(1);
+  }
+}
+
+#define TLS_NTHREADS 4
+__thread int tls_value = 42;
+__thread int tls_zero;
+int tls_failed;
+
+void tls_start_func(void)
+{
+  int me = kthread_id();
+
+  if (tls_value != 42 || tls_zero != 0)
+    __sync_fetch_and_add(&tls_failed, 1);
+  for (int i = 0; i < 100; i++)
+  {
+    tls_value = me;
+    tls_zero += 1;
+    nanosleep(1000); // block, so other kthreads run in between
+    if (tls_value != me || tls_zero != i + 1)
+      __sync_fetch_and_add(&tls_failed, 1);
+  }
+  kthread_exit(0);
+}
+
+// each kthread sees its own copy of __thread variables.
+void tlstest(char *s)
+{
+  int tids[TLS_NTHREADS];
+  void *stacks[TLS_NTHREADS];
+  void *blocks[TLS_NTHREADS];
+
+  tls_failed = 0;
+  tls_value = 7;
+  for (int i = 0; i < TLS_NTHREADS; i++)
+  {
+    stacks[i] = malloc(MAX_STACK_SIZE);
+    blocks[i] = malloc(kthread_tls_size());
+    tids[i] = kthread_create((void *(*)())tls_start_func, stacks[i], MAX_STACK_SIZE,
+                             kthread_tls_init(blocks[i]));
+    if (tids[i] <= 0)
+    {
+      printf("%s: kthread_create failed\n", s);
+      exit(1);
+    }
+  }
+  for (int i = 0; i < TLS_NTHREADS; i++)
+  {
+    if (kthread_join(tids[i], 0) != 0)
+    {
+      printf("%s: kthread_join failed\n", s);
+      exit(1);
+    }
+    free(stacks[i]);
+    free(blocks[i]);
+  }
+  if (tls_failed || tls_value != 7 || tls_zero != 0)
+  {
+    printf("%s: thread-local variables were shared\n", s);
+    exit(1);
+  }
+}
+
+int affinity_child;
+
+void affinity_start_func(void)
+{
+  affinity_child = kthread_getaffinity(kthread_id());
+  kthread_exit(0);
+}
+
+// kthreads can be pinned to a cpu; new kthreads inherit the mask.
+void affinitytest(char *s)
+{
+  int me = kthread_id();
+  void *stack;
+  int tid;
+
+  if (kthread_setaffinity(me, 0) != -1)
+  {
+    printf("%s: empty affinity mask accepted\n", s);
+    exit(1);
+  }
+  if (kthread_getaffinity(me + 1000) != -1)
+  {
+    printf("%s: getaffinity of bad tid succeeded\n", s);
+    exit(1);
+  }
+  if (kthread_setaffinity(me, 1) != 0 || kthread_getaffinity(me) != 1)
+  {
+    printf("%s: could not pin to cpu 0\n", s);
+    exit(1);
+  }
+
+  stack = malloc(MAX_STACK_SIZE);
+  affinity_child = 0;
+  tid = kthread_create((void *(*)())affinity_start_func, stack, MAX_STACK_SIZE, 0);
+  if (tid <= 0 || kthread_join(tid, 0) != 0)
+  {
+    printf("%s: kthread_create/join failed\n", s);
+    exit(1);
+  }
+  free(stack);
+  if (affinity_child != 1)
+  {
+    printf("%s: child affinity %d, expected 1\n", s, affinity_child);
+    exit(1);
+  }
+
+  if (kthread_setaffinity(me, -1) != 0 || kthread_getaffinity(me) == 1)
+  {
+    printf("%s: could not unpin\n", s);
+    exit(1);
+  }
+}
+
+// nice() moves the calling kthread's base priority level,
+// clamped to the levels the scheduler has.
+void nicetest(char *s)
+{
+  int lowest;
+
+  if (nice(0) != 0 || nice(1) != 1)
+  {
+    printf("%s: nice did not start at level 0\n", s);
+    exit(1);
+  }
+  lowest = nice(100);
+  if (lowest < 1 || nice(0) != lowest)
+  {
+    printf("%s: nice(100) returned %d\n", s, lowest);
+    exit(1);
+  }
+  if (nice(-100) != 0)
+  {
+    printf("%s: nice(-100) did not return to level 0\n", s);
+    exit(1);
+  }
+}
+
+// schedstat() reports online cpus and the calling kthread.
+void schedstattest(char *s)
+{
+  static struct cpustat cs[NCPU];
+  static struct kthreadstat ks[NTHREAD];
+  int n, found = 0;
+
+  sleep(1); // at least one voluntary switch
+  if (schedstat(SCHEDSTAT_CPU, cs, NCPU) < 1)
+  {
+    printf("%s: no cpus reported\n", s);
+    exit(1);
+  }
+  if ((n = schedstat(SCHEDSTAT_KTHREAD, ks, NTHREAD)) < 1)
+  {
+    printf("%s: no kthreads reported\n", s);
+    exit(1);
+  }
+  for (int i = 0; i < n; i++)
+  {
+    if (ks[i].pid == getpid() && ks[i].tid == kthread_id())
+    {
+      found = 1;
+      if (ks[i].nvcsw == 0 || ks[i].cputime == 0)
+      {
+        printf("%s: missing switch or cpu time\n", s);
+        exit(1);
+      }
+    }
+  }
+  if (!found)
+  {
+    printf("%s: calling kthread not reported\n", s);
+    exit(1);
+  }
+  if (schedstat(SCHEDSTAT_SLAB + 1, ks, 1) != -1)
+  {
+    printf("%s: bad query accepted\n", s);
+    exit(1);
+  }
+}
+
+// the page allocator's per-cpu counters should account for
+// pages the test allocates and frees.
+void kmemstattest(char *s)
+{
+  static struct kmemstat ms[NCPU];
+  uint64 nalloc0 = 0, nalloc1 = 0, nkfree0 = 0, nkfree1 = 0;
+  int n, npages = 64;
+  char *p;
+
+  if ((n = schedstat(SCHEDSTAT_KMEM, ms, NCPU)) < 1)
+  {
+    printf("%s: no cpus reported\n", s);
+    exit(1);
+  }
+  for (int i = 0; i < n; i++)
+  {
+    nalloc0 += ms[i].nalloc;
+    nkfree0 += ms[i].nkfree;
+  }
+  p = sbrk(npages * PGSIZE);
+  for (int i = 0; i < npages; i++)
+    p[i * PGSIZE] = 1;
+  sbrk(-npages * PGSIZE);
+  n = schedstat(SCHEDSTAT_KMEM, ms, NCPU);
+  for (int i = 0; i < n; i++)
+  {
+    nalloc1 += ms[i].nalloc;
+    nkfree1 += ms[i].nkfree;
+  }
+  if (nalloc1 - nalloc0 < npages || nkfree1 - nkfree0 < npages)
+  {
+    printf("%s: %d pages not counted\n", s, npages);
+    exit(1);
+  }
+
+  // the pool's free blocks should account for all its pages.
+  static struct buddystat bs;
+  uint64 npool = 0;
+  if (schedstat(SCHEDSTAT_BUDDY, &bs, 1) != 1)
+  {
+    printf("%s: no buddy stats\n", s);
+    exit(1);
+  }
+  for (int k = 0; k <= KMAXORDER; k++)
+    npool += bs.nblock[k] << k;
+  if (npool != bs.npool)
+  {
+    printf("%s: free blocks hold %d pages, pool has %d\n", s, (int)npool, bs.npool);
+    exit(1);
+  }
+}
+
+// pipes come from the kernel's "pipe" object cache.
+static int
+pipesinuse(char *s)
+{
+  static struct slabstat ss[16];
+  int n = schedstat(SCHEDSTAT_SLAB, ss, 16);
+
+  for (int i = 0; i < n; i++)
+    if (strcmp(ss[i].name, "pipe") == 0)
+      return ss[i].ninuse;
+  printf("%s: no pipe cache\n", s);
+  exit(1);
+}
+
+void slabtest(char *s)
+{
+  int fds[6][2], n0;
+
+  n0 = pipesinuse(s);
+  for (int i = 0; i < 6; i++)
+  {
+    if (pipe(fds[i]) < 0)
+    {
+      printf("%s: pipe failed\n", s);
+      exit(1);
+    }
+  }
+  if (pipesinuse(s) != n0 + 6)
+  {
+    printf("%s: 6 pipes, %d objects\n", s, pipesinuse(s) - n0);
+    exit(1);
+  }
+  for (int i = 0; i < 6; i++)
+  {
+    close(fds[i][0]);
+    close(fds[i][1]);
+  }
+  if (pipesinuse(s) != n0)
+  {
+    printf("%s: closed pipes not freed\n", s);
+    exit(1);
+  }
+}
+
+// nanosleep() ends between clock ticks; sleep() still
+// waits whole ticks.
+void nanosleeptest(char *s)
+{
+  int t0;
+
+  t0 = uptime();
+  for (int i = 0; i < 10; i++)
+  {
+    if (nanosleep(1000000) != 0) // 1ms, a hundredth of a tick
+    {
+      printf("%s: nanosleep failed\n", s);
+      exit(1);
+    }
+  }
+  if (uptime() - t0 > 5)
+  {
+    printf("%s: 10ms of nanosleep took %d ticks\n", s, uptime() - t0);
+    exit(1);
+  }
+
+  t0 = uptime();
+  sleep(3);
+  if (uptime() - t0 < 2)
+  {
+    printf("%s: sleep(3) returned early\n", s);
+    exit(1);
+  }
+}
+
+// the vdso pages agree with the system calls they stand in for.
+void vdsotest(char *s)
+{
+  const struct vdsoproc *vp = vdso_proc();
+  uint64 n0, t0;
+  uint ticks;
+
+  if (vp->pid != getpid())
+  {
+    printf("%s: vdso pid %d, getpid %d\n", s, vp->pid, getpid());
+    exit(1);
+  }
+  n0 = vp->nsyscall;
+  getpid();
+  if (vp->nsyscall <= n0)
+  {
+    printf("%s: syscall counter did not move\n", s);
+    exit(1);
+  }
+
+  ticks = vdso_ticks();
+  if (ticks > uptime() || uptime() - ticks > 1)
+  {
+    printf("%s: vdso ticks %d, uptime %d\n", s, ticks, uptime());
+    exit(1);
+  }
+  t0 = vdso_nsec();
+  sleep(1);
+  if (vdso_nsec() <= t0)
+  {
+    printf("%s: vdso clock did not advance\n", s);
+    exit(1);
+  }
+
+  // the pages are read-only.
+  int pid = fork();
+  if (pid == 0)
+  {
+    ((struct vdsoproc *)vp)->nsyscall = 0;
+    exit(0);
+  }
+  int xstatus;
+  wait(&xstatus);
+  if (xstatus != -1)
+  {
+    printf("%s: wrote to the vdso page\n", s);
+    exit(1);
+  }
+}
+
+// fork children of a parent too big to copy three times over;
+// each side must see only its own writes, including writes
+// made by the kernel through copyout().
+void cowtest(char *s)
+{
+  int sz = 40 * 1024 * 1024;
+  int fds[2], sync[2], xstatus;
+  char *p;
+
+  p = sbrk(sz);
+  if (p == (char *)-1)
+  {
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for (int i = 0; i < sz; i += PGSIZE)
+    p[i] = i / PGSIZE;
+
+  // the children run at once, so each copies only a third
+  // of the pages, or together they would need more memory
+  // than the machine has.
+  for (int k = 0; k < 3; k++)
+  {
+    int pid = fork();
+    if (pid < 0)
+    {
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if (pid == 0)
+    {
+      for (int i = 0; i < sz; i += PGSIZE)
+      {
+        if (p[i] != (char)(i / PGSIZE))
+          exit(1);
+        if ((i / PGSIZE) % 3 == k)
+          p[i] = -1;
+      }
+      exit(0);
+    }
+  }
+  for (int k = 0; k < 3; k++)
+  {
+    wait(&xstatus);
+    if (xstatus != 0)
+    {
+      printf("%s: child saw wrong data\n", s);
+      exit(1);
+    }
+  }
+
+  // copyout() into a page shared with a live child.
+  if (pipe(fds) < 0 || pipe(sync) < 0)
+  {
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  int pid = fork();
+  if (pid == 0)
+  {
+    read(sync[0], &xstatus, 1); // wait for the parent's read below
+    exit(p[0] == 0 ? 0 : 1);
+  }
+  if (write(fds[1], "x", 1) != 1 || read(fds[0], p, 1) != 1)
+  {
+    printf("%s: pipe i/o failed\n", s);
+    exit(1);
+  }
+  write(sync[1], "y", 1);
+  wait(&xstatus);
+  if (p[0] != 'x' || xstatus != 0)
+  {
+    printf("%s: copyout wrote through to the child\n", s);
+    exit(1);
+  }
+  for (int i = PGSIZE; i < sz; i += PGSIZE)
+  {
+    if (p[i] != (char)(i / PGSIZE))
+    {
+      printf("%s: parent saw a child's write\n", s);
+      exit(1);
+    }
+  }
+  close(fds[0]);
+  close(fds[1]);
+  close(sync[0]);
+  close(sync[1]);
+  sbrk(-sz);
+}
+
+// mmap(): anonymous and file-backed regions, MAP_SHARED write-back,
+// MAP_PRIVATE copies, and sharing with a forked child.
+void mmaptest(char *s)
+{
+  char *f = "mmaptest.tmp";
+  static char buf[PGSIZE];
+  char *p;
+  int fd, fd2, pid, xstatus;
+
+  fd = open(f, O_CREATE | O_RDWR);
+  for (int i = 0; i < 2; i++)
+  {
+    memset(buf, 'a' + i, PGSIZE);
+    if (write(fd, buf, PGSIZE) != PGSIZE)
+    {
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+
+  p = mmap(0, 2 * PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == (char *)-1)
+  {
+    printf("%s: mmap of file failed\n", s);
+    exit(1);
+  }
+  if (p[0] != 'a' || p[PGSIZE] != 'b' || p[2 * PGSIZE - 1] != 'b')
+  {
+    printf("%s: wrong file data in mapping\n", s);
+    exit(1);
+  }
+  p[1] = 'X';
+  // read() into the mapping is written back too.
+  fd2 = open(f, O_RDONLY);
+  if (read(fd2, p + PGSIZE, 4) != 4 || p[PGSIZE] != 'a')
+  {
+    printf("%s: read into mapping failed\n", s);
+    exit(1);
+  }
+  close(fd2);
+  if (munmap(p, 2 * PGSIZE) != 0)
+  {
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open(f, O_RDONLY);
+  if (read(fd, buf, 2) != 2 || buf[1] != 'X' ||
+      read(fd, buf, PGSIZE) != PGSIZE || buf[PGSIZE - 2] != 'a')
+  {
+    printf("%s: MAP_SHARED changes not written back\n", s);
+    exit(1);
+  }
+
+  // private: changes stay in the process.
+  p = mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (p == (char *)-1 || p[1] != 'X')
+  {
+    printf("%s: MAP_PRIVATE mmap failed\n", s);
+    exit(1);
+  }
+  p[1] = 'Y';
+  munmap(p, PGSIZE);
+  close(fd);
+  fd = open(f, O_RDONLY);
+  if (read(fd, buf, 2) != 2 || buf[1] != 'X')
+  {
+    printf("%s: MAP_PRIVATE change written back\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink(f);
+
+  // anonymous, shared with a child; gone after munmap.
+  p = mmap(0, 3 * PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (p == (char *)-1 || p[PGSIZE] != 0)
+  {
+    printf("%s: anonymous mmap failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if (pid == 0)
+  {
+    p[PGSIZE] = 42;
+    exit(0);
+  }
+  wait(&xstatus);
+  if (p[PGSIZE] != 42)
+  {
+    printf("%s: MAP_SHARED page not shared with child\n", s);
+    exit(1);
+  }
+  // pages neither process had touched before fork().
+  pid = fork();
+  if (pid == 0)
+  {
+    p[2 * PGSIZE] = 43;
+    exit(0);
+  }
+  wait(&xstatus);
+  if (p[2 * PGSIZE] != 43)
+  {
+    printf("%s: untouched MAP_SHARED page not shared\n", s);
+    exit(1);
+  }
+  munmap(p, 3 * PGSIZE);
+  pid = fork();
+  if (pid == 0)
+  {
+    p[PGSIZE] = 1;
+    exit(0);
+  }
+  wait(&xstatus);
+  if (xstatus != -1)
+  {
+    printf("%s: unmapped page still accessible\n", s);
+    exit(1);
+  }
+}
+
+// fetching an instruction from a heap page, or loading from
+// an execute-only region, kills the process.
+void noexec(char *s)
+{
+  int xstatus;
+  char *p;
+
+  p = sbrk(PGSIZE);
+  p[0] = 0;
+  if (fork() == 0)
+  {
+    ((void (*)(void))p)();
+    exit(0);
+  }
+  wait(&xstatus);
+  if (xstatus != -1)
+  {
+    printf("%s: ran code from the heap\n", s);
+    exit(1);
+  }
+
+  p = mmap(0, PGSIZE, PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == (char *)-1)
+  {
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  if (fork() == 0)
+  {
+    exit(p[0]);
+  }
+  wait(&xstatus);
+  if (xstatus != -1)
+  {
+    printf("%s: read an execute-only page\n", s);
+    exit(1);
+  }
+  munmap(p, PGSIZE);
+  sbrk(-PGSIZE);
+}
+
+// shared-memory segments: found by key from an unrelated
+// attach, shared across fork(), freed after the last detach
+// or, if never attached, by shmrm().
+void shmtest(char *s)
+{
+  int key = 0x5eed, id, pid, xstatus;
+  char *p, *q;
+
+  if ((id = shmget(key, 2 * PGSIZE)) < 0 || (p = shmat(id)) == (char *)-1)
+  {
+    printf("%s: shmget/shmat failed\n", s);
+    exit(1);
+  }
+  p[0] = 1;
+  pid = fork();
+  if (pid == 0)
+  {
+    // a second attachment, by key, next to the inherited one.
+    q = shmat(shmget(key, PGSIZE));
+    if (q == (char *)-1 || q == p || q[0] != 1)
+      exit(1);
+    q[PGSIZE] = 2;
+    p[1] = 3;
+    shmdt(q);
+    exit(0);
+  }
+  wait(&xstatus);
+  if (xstatus != 0 || p[PGSIZE] != 2 || p[1] != 3)
+  {
+    printf("%s: child's writes not shared\n", s);
+    exit(1);
+  }
+
+  // processes attached can wait on each other with futexes.
+  int *w = (int *)(p + 8);
+  *w = 0;
+  pid = fork();
+  if (pid == 0)
+  {
+    while (*w == 0)
+      futex(w, FUTEX_WAIT, 0);
+    exit(0);
+  }
+  sleep(1);
+  *w = 1;
+  if (futex(w, FUTEX_WAKE, 1) < 0)
+  {
+    printf("%s: futex on a segment failed\n", s);
+    exit(1);
+  }
+  wait(&xstatus);
+
+  if (shmdt(p) != 0 || shmdt(p) != -1)
+  {
+    printf("%s: shmdt failed\n", s);
+    exit(1);
+  }
+
+  // the last detach freed it: the key gives a new segment.
+  if ((id = shmget(key, PGSIZE)) < 0 || (p = shmat(id)) == (char *)-1 || p[0] != 0)
+  {
+    printf("%s: segment outlived its last detach\n", s);
+    exit(1);
+  }
+
+  // removed while attached: still mapped, but no longer found.
+  if (shmrm(id) != 0 || shmrm(id) != -1 || shmat(id) != (char *)-1)
+  {
+    printf("%s: shmrm of an attached segment failed\n", s);
+    exit(1);
+  }
+  p[0] = 4;
+  if ((id = shmget(key, PGSIZE)) < 0 || (q = shmat(id)) == (char *)-1 || q[0] != 0)
+  {
+    printf("%s: removed segment still found by key\n", s);
+    exit(1);
+  }
+  shmdt(q);
+  shmrm(id);
+  shmdt(p);
+
+  // segments never attached don't use up the table.
+  for (int i = 0; i < 2 * NSHM; i++)
+  {
+    if ((id = shmget(0, PGSIZE)) < 0 || shmrm(id) != 0)
+    {
+      printf("%s: unattached segment not removed\n", s);
+      exit(1);
+    }
+  }
+}
+
+// exec() reads the program in as it is touched, including
+// by a pipe read or write, which copies with a lock held.
+static char demanddata[3 * PGSIZE] = {1, 2, 3};
+
+void execdemand(char *s)
+{
+  int fds[2];
+  char buf[4];
+
+  if (pipe(fds) < 0)
+  {
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if (write(fds[1], demanddata, 3) != 3 ||
+      read(fds[0], demanddata + 2 * PGSIZE, 3) != 3 ||
+      write(fds[1], demanddata + PGSIZE, 1) != 1 ||
+      read(fds[0], buf, 1) != 1)
+  {
+    printf("%s: pipe i/o failed\n", s);
+    exit(1);
+  }
+  if (demanddata[2 * PGSIZE + 2] != 3 || demanddata[PGSIZE + 1] != 0 || buf[0] != 0)
+  {
+    printf("%s: wrong program data\n", s);
+    exit(1);
+  }
+}
+
+// sbrk() should only reserve memory; pages are allocated, zeroed,
+// when first touched, by the user or by copyin()/copyout().
+void lazysbrk(char *s)
+{
+  uint64 sz = 1024 * 1024 * 1024; // far more than the machine has
+  int fds[2];
+  char buf[8];
+  char *p;
+
+  p = sbrk(sz);
+  if (p == (char *)-1)
+  {
+    printf("%s: sbrk of untouched memory failed\n", s);
+    exit(1);
+  }
+  p[0] = 1;
+  p[sz - 1] = 2;
+  if (p[sz / 2] != 0 || p[0] != 1 || p[sz - 1] != 2)
+  {
+    printf("%s: wrong data in lazy pages\n", s);
+    exit(1);
+  }
+
+  if (pipe(fds) < 0)
+  {
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  memset(buf, 'x', sizeof(buf));
+  if (write(fds[1], p + sz / 4, sizeof(buf)) != sizeof(buf) ||
+      read(fds[0], buf, sizeof(buf)) != sizeof(buf) || buf[0] != 0)
+  {
+    printf("%s: copyin from an untouched page failed\n", s);
+    exit(1);
+  }
+  if (write(fds[1], "lazy", 4) != 4 || read(fds[0], p + sz / 8, 4) != 4 ||
+      memcmp(p + sz / 8, "lazy", 4) != 0)
+  {
+    printf("%s: copyout to an untouched page failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  if (sbrk(-sz) == (char *)-1)
+  {
+    printf("%s: sbrk could not shrink\n", s);
+    exit(1);
+  }
+}
+
 struct test
 {
   void (*f)(char *);
@@ -3117,6 +4008,22 @@ struct test
     {badarg, "badarg"},
     {ulttest, "ulttest"},
     {klttest, "klttest"},
+    {futextest, "futextest"},
+    {widethreads, "widethreads"},
+    {tlstest, "tlstest"},
+    {affinitytest, "affinitytest"},
+    {nicetest, "nicetest"},
+    {schedstattest, "schedstattest"},
+    {kmemstattest, "kmemstattest"},
+    {slabtest, "slabtest"},
+    {nanosleeptest, "nanosleeptest"},
+    {vdsotest, "vdsotest"},
+    {cowtest, "cowtest"},
+    {lazysbrk, "lazysbrk"},
+    {mmaptest, "mmaptest"},
+    {noexec, "noexec"},
+    {shmtest, "shmtest"},
+    {execdemand, "execdemand"},
 
     {0, 0},
 };
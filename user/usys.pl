@@ -28,6 +28,18 @@ entry("kthread_exit");
 entry("kthread_id");
 entry("kthread_join");
 entry("kthread_kill");
+entry("futex");
+entry("kthread_setaffinity");
+entry("kthread_getaffinity");
+entry("nice");
+entry("schedstat");
+entry("nanosleep");
+entry("mmap");
+entry("munmap");
+entry("shmget");
+entry("shmat");
+entry("shmdt");
+entry("shmrm");
 entry("exec");
 entry("open");
 entry("mknod");